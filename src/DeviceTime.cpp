@@ -0,0 +1,15 @@
+#include "DeviceTime.h"
+#include "pico/time.h"
+
+uint32_t DeviceTime::base = 0;
+
+uint32_t DeviceTime::now() {
+    return base + static_cast<uint32_t>(time_us_64() / 1000000);
+}
+
+void DeviceTime::restore(uint32_t last_seen) {
+    uint32_t uptime = static_cast<uint32_t>(time_us_64() / 1000000);
+    if (last_seen + 1 > base + uptime) {
+        base = last_seen + 1 - uptime;
+    }
+}
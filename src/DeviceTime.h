@@ -0,0 +1,19 @@
+#ifndef DEVICETIME_H
+#define DEVICETIME_H
+
+#include <cstdint>
+
+// Seconds on a clock that keeps counting over reboots: uptime plus a base taken from the
+// newest timestamp found in persistent storage at boot. There is no RTC on the board so
+// time spent powered off is not counted, but timestamps of stored records never go backwards.
+class DeviceTime {
+public:
+    static uint32_t now();
+    // moves the clock forward so that now() is after a timestamp seen in storage
+    static void restore(uint32_t last_seen);
+
+private:
+    static uint32_t base;
+};
+
+#endif //DEVICETIME_H
@@ -0,0 +1,130 @@
+#include "Config.h"
+#include "EEPROM.h"
+
+#include <cstring>
+#include <cstdio>
+
+struct ConfigField {
+    ConfigType type;
+    uint8_t size;       // bytes in the mirror
+    uint8_t offset;
+    uint32_t value;     // default of numbers
+};
+
+static constexpr ConfigField schema[CFG_KEY_COUNT] = {
+    {CFG_U8, 1, 0, RUN_STATE_NONE},
+    {CFG_U16, 2, 2, 700},
+    {CFG_STR, CONFIG_STR_SIZE, 4, 0},
+    {CFG_STR, CONFIG_STR_SIZE, 4 + CONFIG_STR_SIZE, 0},
+};
+
+Config::Config() {
+    std::memset(data, 0, sizeof(data));
+    for (uint8_t k = 0; k < CFG_KEY_COUNT; k++) {
+        if (schema[k].type != CFG_STR) {
+            set(static_cast<ConfigKey>(k), schema[k].value);
+        }
+    }
+}
+
+ConfigType Config::type(ConfigKey key) {
+    return schema[key].type;
+}
+
+uint8_t *Config::field(ConfigKey key) {
+    return data + schema[key].offset;
+}
+
+const uint8_t *Config::field(ConfigKey key) const {
+    return data + schema[key].offset;
+}
+
+uint32_t Config::get(ConfigKey key) const {
+    uint32_t value = 0;
+    std::memcpy(&value, field(key), schema[key].size);
+    return value;
+}
+
+const char *Config::get_str(ConfigKey key) const {
+    return reinterpret_cast<const char *>(field(key));
+}
+
+bool Config::set(ConfigKey key, uint32_t value) {
+    if (get(key) == value) {
+        return false;
+    }
+    std::memcpy(field(key), &value, schema[key].size);
+    return true;
+}
+
+bool Config::set(ConfigKey key, const char *value) {
+    char *str = reinterpret_cast<char *>(field(key));
+    if (strncmp(str, value, CONFIG_STR_SIZE - 1) == 0) {
+        return false;
+    }
+    strncpy(str, value, CONFIG_STR_SIZE - 1);
+    str[CONFIG_STR_SIZE - 1] = '\0';
+    return true;
+}
+
+size_t Config::serialize(uint8_t *block, size_t max_len, uint32_t seq) const {
+    ConfigHeader header = {0, 0, CONFIG_MAGIC, CONFIG_VERSION, 0, seq};
+    size_t len = sizeof(header);
+
+    for (uint8_t k = 0; k < CFG_KEY_COUNT; k++) {
+        auto key = static_cast<ConfigKey>(k);
+        size_t value_len = schema[k].type == CFG_STR ? strlen(get_str(key)) : schema[k].size;
+        if (len + 2 + value_len > max_len) {
+            return 0;
+        }
+        block[len++] = key;
+        block[len++] = value_len;
+        std::memcpy(block + len, field(key), value_len);
+        len += value_len;
+        header.count++;
+    }
+
+    header.len = len;
+    std::memcpy(block, &header, sizeof(header));
+    header.crc = EEPROM::crc16(block + sizeof(header.crc), len - sizeof(header.crc));
+    std::memcpy(block, &header.crc, sizeof(header.crc));
+    return len;
+}
+
+bool Config::parse(const uint8_t *block, size_t max_len, uint32_t *seq) {
+    ConfigHeader header;
+    std::memcpy(&header, block, sizeof(header));
+    if (header.magic != CONFIG_MAGIC || header.len < sizeof(header) || header.len > max_len ||
+        EEPROM::crc16(block + sizeof(header.crc), header.len - sizeof(header.crc)) != header.crc) {
+        return false;
+    }
+    // A block of another layout is not read as this one. Layout changes that keep the settings
+    // convert older versions here, until then the block is treated as missing
+    if (header.version != CONFIG_VERSION) {
+        printf("Config block version %u, expected %u\n", header.version, CONFIG_VERSION);
+        return false;
+    }
+
+    size_t pos = sizeof(header);
+    for (uint8_t i = 0; i < header.count && pos + 2 <= header.len; i++) {
+        uint8_t key = block[pos];
+        uint8_t value_len = block[pos + 1];
+        pos += 2;
+        if (pos + value_len > header.len) {
+            return false;
+        }
+        // a key of a newer schema or with a different size is left at its default
+        if (key < CFG_KEY_COUNT) {
+            const ConfigField &f = schema[key];
+            if (f.type == CFG_STR && value_len < f.size) {
+                std::memcpy(data + f.offset, block + pos, value_len);
+                data[f.offset + value_len] = '\0';
+            } else if (f.type != CFG_STR && value_len == f.size) {
+                std::memcpy(data + f.offset, block + pos, value_len);
+            }
+        }
+        pos += value_len;
+    }
+    *seq = header.seq;
+    return true;
+}
@@ -0,0 +1,72 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <cstdint>
+#include <cstddef>
+
+#define CONFIG_MAGIC 0x4643 // "CF"
+#define CONFIG_VERSION 1
+// longest string value with its terminator
+#define CONFIG_STR_SIZE 64
+
+// Keys are stored in the block, so their numbers must not change. New keys are added at the
+// end, a block without them loads with the defaults from the schema
+enum ConfigKey : uint8_t {
+    CFG_RUN_STATE,  // RunState, tells a crash from a normal restart
+    CFG_CO2_SET,    // default co2 set level of zone 0, ppm. Changes go to SETTING_CO2_SET, its wear ring
+    CFG_WIFI_SSID,
+    CFG_WIFI_PASS,
+    CFG_KEY_COUNT
+};
+
+enum ConfigType : uint8_t {
+    CFG_U8,
+    CFG_U16,
+    CFG_U32,
+    CFG_STR,
+};
+
+enum RunState : uint8_t {
+    RUN_STATE_NONE,     // first start
+    RUN_STATE_RUNNING,
+    RUN_STATE_STOPPED,  // shut down on purpose
+};
+
+// block header, followed by [key][len][value] entries, numbers little endian
+struct ConfigHeader {
+    uint16_t crc;       // over everything after this field
+    uint16_t len;       // header and entries
+    uint16_t magic;
+    uint8_t version;
+    uint8_t count;      // entries
+    uint32_t seq;       // newer block of the two slots wins
+};
+static_assert(sizeof(ConfigHeader) == 12, "config header layout");
+
+// RAM mirror of the typed settings with (de)serialization of the stored block. No locking,
+// the owner serializes access
+class Config {
+public:
+    Config();
+
+    uint32_t get(ConfigKey key) const;
+    const char *get_str(ConfigKey key) const;
+    // false if the value didn't change
+    bool set(ConfigKey key, uint32_t value);
+    bool set(ConfigKey key, const char *value);
+
+    // writes the block, returns its length
+    size_t serialize(uint8_t *block, size_t max_len, uint32_t seq) const;
+    // loads a valid block of this version into this mirror, unknown keys are skipped
+    bool parse(const uint8_t *block, size_t max_len, uint32_t *seq);
+
+    static ConfigType type(ConfigKey key);
+
+private:
+    uint8_t *field(ConfigKey key);
+    const uint8_t *field(ConfigKey key) const;
+
+    uint8_t data[2 * CONFIG_STR_SIZE + 8];
+};
+
+#endif //CONFIG_H
@@ -1,15 +1,35 @@
 #include "EEPROM/EEPROM.h"
+#include "DeviceTime.h"
 
 #include <array>
 #include <vector>
 #include <bits/fs_fwd.h>
 
 EEPROM::EEPROM(std::shared_ptr<PicoI2C> i2cbus, uint8_t address):
-    i2c(std::move(i2cbus)), addr(address) {}
+    i2c(std::move(i2cbus)), addr(address), log_journal(*this, LOG_ADDR, EVENT_SLOT_SIZE, LOG_COUNT),
+    setting_rings{Journal(*this, CO2_SET_RING_ADDR, SETTING_SLOT_SIZE, SETTING_SLOTS),
+                  Journal(*this, FAN_SPEED_RING_ADDR, SETTING_SLOT_SIZE, SETTING_SLOTS),
+                  Journal(*this, SAMPLE_CURSOR_RING_ADDR, SETTING_SLOT_SIZE, SETTING_SLOTS)},
+    epoch_ring(*this, EPOCH_RING_ADDR, SETTING_SLOT_SIZE, SETTING_SLOTS),
+    sample_journal(*this, SAMPLE_ADDR, SAMPLE_SLOT_SIZE, SAMPLE_COUNT) {}
+
+bool EEPROM::begin() {
+    uint8_t payload[SETTING_SLOT_SIZE - JOURNAL_OVERHEAD];
+    if (epoch_ring.newest(payload)) {
+        device_epoch = payload[0] | (payload[1] << 8);
+        log_epoch = payload[2] | (payload[3] << 8);
+    }
+    log_journal.set_epoch(log_epoch);
+    for (auto &ring: setting_rings) {
+        ring.set_epoch(device_epoch);
+    }
+    sample_journal.set_epoch(device_epoch);
+    printf("EEPROM epochs: device %u, log %u\n", device_epoch, log_epoch);
+    return true;
+}
 
-uint16_t EEPROM::crc16(const uint8_t *buffer_p, size_t buffer_len) {
+uint16_t EEPROM::crc16(const uint8_t *buffer_p, size_t buffer_len, uint16_t crc) {
     uint8_t x;
-    uint16_t crc = 0xFFFF;
 
     while (buffer_len--) {
         x = (crc >> 8) ^ *buffer_p++;
@@ -19,31 +39,120 @@ uint16_t EEPROM::crc16(const uint8_t *buffer_p, size_t buffer_len) {
     return crc;
 }
 
+void EEPROM::rulesHeader(uint8_t *image, size_t len) {
+    uint16_t crc = crc16(image + RULES_HEADER_SIZE, len);
+    image[0] = len & 0xFF;
+    image[1] = len >> 8;
+    image[2] = crc & 0xFF;
+    image[3] = crc >> 8;
+}
+
+uint16_t EEPROM::epochSeed(uint16_t epoch) {
+    if (epoch == 0) {
+        return 0xFFFF;
+    }
+    uint8_t bytes[2] = {static_cast<uint8_t>(epoch & 0xFF), static_cast<uint8_t>(epoch >> 8)};
+    return crc16(bytes, sizeof(bytes));
+}
+
 bool EEPROM::validateCrc(const uint8_t *data_buffer, size_t message_len) {
     uint16_t stored_crc = (static_cast<uint16_t>(data_buffer[message_len + 1]) << 8) |
                           static_cast<uint16_t>(data_buffer[message_len + 2]);
-    uint16_t calculated_crc = crc16(data_buffer, message_len + 1);
+    uint16_t calculated_crc = crc16(data_buffer, message_len + 1, epochSeed(device_epoch));
     return calculated_crc == stored_crc;
 }
 
-// basic write
+// basic write, split at page boundaries since the eeprom wraps around inside a page
 bool EEPROM::eepromWrite(uint16_t address, const uint8_t *data, size_t data_len) {
-    std::array<uint8_t, 2> addr_buf = {
-        static_cast<uint8_t>((address >> 8) & 0xFF),
-        static_cast<uint8_t>(address & 0xFF)
-    };
+    while (data_len > 0) {
+        size_t chunk = EEPROM_PAGE_SIZE - (address % EEPROM_PAGE_SIZE);
+        if (chunk > data_len) chunk = data_len;
+        if (!stage(address, data, chunk)) {
+            return false;
+        }
+        address += chunk;
+        data += chunk;
+        data_len -= chunk;
+    }
+    return true;
+}
 
-    std::vector<uint8_t> data_buf(data_len + 2);
-    std::memcpy(data_buf.data(), addr_buf.data(), addr_buf.size());
-    std::memcpy(data_buf.data() + 2, data, data_len);
+// adds bytes of one page to the page buffer. Writes that continue or overlap the buffered
+// range are merged, anything else writes the buffer out first
+bool EEPROM::stage(uint16_t address, const uint8_t *data, size_t data_len) {
+    bool mergeable = pending_len > 0 &&
+                     address / EEPROM_PAGE_SIZE == pending_addr / EEPROM_PAGE_SIZE &&
+                     address >= pending_addr && address <= pending_addr + pending_len;
+    if (!mergeable) {
+        if (!flush()) {
+            return false;
+        }
+        pending_addr = address;
+        page_buffer[0] = static_cast<uint8_t>((address >> 8) & 0xFF);
+        page_buffer[1] = static_cast<uint8_t>(address & 0xFF);
+    }
 
-    uint result = i2c->write(addr, data_buf.data(), data_len + 2);
-    // 5ms for writing
-    vTaskDelay(pdMS_TO_TICKS(5));
-    return result == (data_len + 2);
+    size_t offset = address - pending_addr;
+    std::memcpy(page_buffer + 2 + offset, data, data_len);
+    if (offset + data_len > pending_len) {
+        pending_len = offset + data_len;
+    }
+    return true;
+}
+
+bool EEPROM::flush() {
+    if (pending_len == 0) {
+        return true;
+    }
+    if (!waitReady()) {
+        printf("EEPROM busy, page write at 0x%04X dropped\n", pending_addr);
+        pending_len = 0;
+        return false;
+    }
+
+    size_t len = pending_len;
+    pending_len = 0;
+    write_start_us = time_us_32();
+    uint result = i2c->write(addr, page_buffer, len + 2);
+    if (result != len + 2) {
+        printf("EEPROM page write at 0x%04X failed\n", pending_addr);
+        return false;
+    }
+    // the chip is now busy with its internal write cycle, it is waited for only when needed
+    write_cycle = true;
+    bytes_written += len;
+    page_writes++;
+    return true;
+}
+
+bool EEPROM::sync() {
+    return flush() && waitReady();
+}
+
+// ack polling: the chip doesn't ack its address until the write cycle is done. The poll is
+// an address only write which just sets the internal address pointer
+bool EEPROM::waitReady() {
+    if (!write_cycle) {
+        return true;
+    }
+    uint8_t address_word[2] = {page_buffer[0], page_buffer[1]};
+    do {
+        ack_polls++;
+        if (i2c->write(addr, address_word, sizeof(address_word)) == sizeof(address_word)) {
+            write_cycle = false;
+            busy_us += time_us_32() - write_start_us;
+            return true;
+        }
+    } while (time_us_32() - write_start_us < EEPROM_WRITE_TIMEOUT_US);
+    return false;
 }
 
 bool EEPROM::eepromRead(uint16_t address, uint8_t *data, size_t data_len) {
+    // buffered bytes go out first so that the read sees them
+    if (!flush() || !waitReady()) {
+        return false;
+    }
+
     std::array<uint8_t, 2> addr_buf = {
         static_cast<uint8_t>((address >> 8) & 0xFF),
         static_cast<uint8_t>(address & 0xFF)
@@ -54,6 +163,37 @@ bool EEPROM::eepromRead(uint16_t address, uint8_t *data, size_t data_len) {
     return result == (addr_buf.size() + data_len);
 }
 
+void EEPROM::printStats() {
+    uint32_t rate = busy_us ? static_cast<uint32_t>(bytes_written * 1000000ULL / busy_us) : 0;
+    printf("EEPROM: %lu bytes in %lu page writes, %lu B/s, %lu ack polls\n",
+           bytes_written, page_writes, rate, ack_polls);
+    if (sample_cursor_known) {
+        printf("Samples: %u waiting, high water %u of %u, %lu overwritten unsent\n",
+               static_cast<uint16_t>(sample_journal.next_sequence() - sample_cursor), sample_high_water,
+               SAMPLE_COUNT, sample_overflows);
+    }
+}
+
+void EEPROM::benchmark() {
+    uint8_t record[EVENT_SLOT_SIZE];
+    for (size_t i = 0; i < sizeof(record); i++) record[i] = i;
+
+    uint32_t bytes_before = bytes_written;
+    uint32_t pages_before = page_writes;
+    uint32_t start = time_us_32();
+    for (uint16_t a = EEPROM_SCRATCH_ADDR; a + sizeof(record) <= EEPROM_SCRATCH_ADDR + EEPROM_SCRATCH_SIZE;
+         a += sizeof(record)) {
+        eepromWrite(a, record, sizeof(record));
+    }
+    flush();
+    waitReady();
+    uint32_t elapsed = time_us_32() - start;
+
+    uint32_t bytes = bytes_written - bytes_before;
+    printf("EEPROM benchmark: %lu bytes, %lu page writes in %lu us, %lu B/s\n", bytes,
+           page_writes - pages_before, elapsed, static_cast<uint32_t>(bytes * 1000000ULL / elapsed));
+}
+
 // writing status to specific address
 bool EEPROM::writeStatus(const uint16_t address, const char *status, size_t max_len) {
     size_t len = strlen(status);
@@ -66,7 +206,7 @@ bool EEPROM::writeStatus(const uint16_t address, const char *status, size_t max_
     std::memcpy(log_message_buff.data(), status, len);
     log_message_buff[len] = '\0';
 
-    uint16_t crc = crc16(log_message_buff.data(), len + 1);
+    uint16_t crc = crc16(log_message_buff.data(), len + 1, epochSeed(device_epoch));
     log_message_buff[len + 1] = static_cast<uint8_t>(crc >> 8);
     log_message_buff[len + 2] = static_cast<uint8_t>(crc & 0xFF);
 
@@ -120,107 +260,201 @@ bool EEPROM::readStatus(uint16_t address, std::string &status_buffer, size_t max
     return true;
 }
 
-// log impl
-uint16_t EEPROM::readLogAddress() {
-    uint16_t log_addr;
-    if (!eepromRead(LOG_ADDR_STORAGE, (uint8_t *)&log_addr, sizeof(log_addr))) {
-        return 0;
+bool EEPROM::writeSetting(SettingKey key, uint16_t value) {
+    if (setting_known[key] && setting_values[key] == value) {
+        return true;
     }
-    return log_addr;
+    uint8_t payload[SETTING_SLOT_SIZE - JOURNAL_OVERHEAD] = {
+        static_cast<uint8_t>(value & 0xFF), static_cast<uint8_t>(value >> 8)
+    };
+    if (!setting_rings[key].append(payload, sizeof(payload))) {
+        return false;
+    }
+    setting_values[key] = value;
+    setting_known[key] = true;
+    return true;
 }
 
-bool EEPROM::writeLogAddress(uint16_t log_addr) {
-    return eepromWrite(LOG_ADDR_STORAGE, (uint8_t *)&log_addr, sizeof(log_addr));
+bool EEPROM::readSetting(SettingKey key, uint16_t *value) {
+    if (!setting_known[key]) {
+        uint8_t payload[SETTING_SLOT_SIZE - JOURNAL_OVERHEAD];
+        if (!setting_rings[key].newest(payload)) {
+            return false;
+        }
+        setting_values[key] = payload[0] | (payload[1] << 8);
+        setting_known[key] = true;
+    }
+    *value = setting_values[key];
+    return true;
 }
 
-bool EEPROM::isLogEmpty(uint16_t *next_addr) {
-    for (uint16_t i = MIN_LOG_ADDR; i <= MAX_LOG_ADDRESS; i += STR_BUFFER_SIZE) {
-        uint8_t read_data[STR_BUFFER_SIZE];
-        if (eepromRead(i, read_data, sizeof(read_data))) {
-            if (read_data[0] == 0) {
-                *next_addr = i;
-                return true;
-            }
+// cursor is kept in a setting ring, without one the uplink starts from the oldest sample
+bool EEPROM::loadSampleCursor() {
+    if (!sample_cursor_known) {
+        if (!readSetting(SETTING_SAMPLE_CURSOR, &sample_cursor)) {
+            sample_cursor = sample_journal.next_sequence() - sample_journal.stored();
         }
+        sample_cursor_known = true;
     }
-    return false;
+    // samples the writer has already overwritten are skipped
+    uint16_t waiting = sample_journal.next_sequence() - sample_cursor;
+    if (waiting > sample_journal.stored()) {
+        sample_overflows += waiting - sample_journal.stored();
+        sample_cursor = sample_journal.next_sequence() - sample_journal.stored();
+    }
+    return true;
 }
 
-bool EEPROM::writeLog(const char *message) {
-    uint16_t log_addr = readLogAddress();
+bool EEPROM::appendSample(const SampleRecord &sample) {
+    loadSampleCursor();
+    uint16_t waiting = sample_journal.next_sequence() - sample_cursor;
+    if (!sample_journal.append(reinterpret_cast<const uint8_t *>(&sample), sizeof(sample))) {
+        return false;
+    }
+    if (waiting >= SAMPLE_COUNT) {
+        // the oldest unsent sample was just overwritten
+        sample_overflows++;
+        sample_cursor++;
+    } else if (waiting + 1 > sample_high_water) {
+        sample_high_water = waiting + 1;
+    }
+    return true;
+}
 
-    // check if log full
-    if (log_addr == 0xFFFF || log_addr > MAX_LOG_ADDRESS) {
-        uint16_t empty_addr;
-        if (!isLogEmpty(&empty_addr)) {
-            printf("Log full, deleting old logs...\n");
-            deleteLogs();
-            log_addr = MIN_LOG_ADDR;
-        } else {
-            log_addr = empty_addr;
-        }
+uint16_t EEPROM::peekSamples(SampleRecord *samples, uint16_t max) {
+    loadSampleCursor();
+    uint16_t waiting = sample_journal.next_sequence() - sample_cursor;
+    uint16_t count = 0;
+    while (count < max && count < waiting &&
+           sample_journal.read_seq(sample_cursor + count, reinterpret_cast<uint8_t *>(&samples[count]))) {
+        count++;
     }
+    return count;
+}
 
-    size_t message_len = strlen(message);
-    if (message_len > STR_BUFFER_SIZE - 3) {
-        message_len = STR_BUFFER_SIZE - 3;
+bool EEPROM::ackSamples(uint16_t count) {
+    loadSampleCursor();
+    uint16_t waiting = sample_journal.next_sequence() - sample_cursor;
+    if (count > waiting) count = waiting;
+    if (count == 0) {
+        return false;
     }
+    sample_cursor += count;
+    return writeSetting(SETTING_SAMPLE_CURSOR, sample_cursor);
+}
 
-    std::vector<uint8_t> log_message_buf(STR_BUFFER_SIZE, 0);
-    std::memcpy(log_message_buf.data(), message, message_len);
-    log_message_buf[message_len] = '\0';
+void EEPROM::sampleStats(SampleStats *stats) {
+    loadSampleCursor();
+    stats->waiting = sample_journal.next_sequence() - sample_cursor;
+    stats->high_water = sample_high_water;
+    stats->dropped = sample_overflows;
+}
 
-    uint16_t crc = crc16(log_message_buf.data(), message_len + 1);
-    log_message_buf[message_len + 1] = static_cast<uint8_t>(crc >> 8);
-    log_message_buf[message_len + 2] = static_cast<uint8_t>(crc & 0xFF);
+// log impl
+bool EEPROM::logEvent(EventCode code, uint8_t zone, uint16_t value) {
+    EventRecord record = {code, zone, value, DeviceTime::now()};
 
-    if (!eepromWrite(log_addr, log_message_buf.data(), STR_BUFFER_SIZE)) {
+    // one 12 byte slot write per entry, the journal keeps the head in RAM
+    if (!log_journal.append(reinterpret_cast<const uint8_t *>(&record), sizeof(record))) {
         printf("Failed to write log to EEPROM\n");
         return false;
     }
+    printf("Log written: %s z%u %u\n", event_name(code), zone, value);
+    return true;
+}
 
-    log_addr += STR_BUFFER_SIZE;
-    if (!writeLogAddress(log_addr)) {
-        printf("Failed to update log address\n");
+bool EEPROM::lastEventTime(uint32_t *time) {
+    EventRecord record;
+    if (!log_journal.newest(reinterpret_cast<uint8_t *>(&record))) {
         return false;
     }
+    *time = record.time;
+    return true;
+}
 
-    printf("Log written successfully at address 0x%04X\n", log_addr - STR_BUFFER_SIZE);
+bool EEPROM::lastSampleTime(uint32_t *time) {
+    SampleRecord sample;
+    if (!sample_journal.newest(reinterpret_cast<uint8_t *>(&sample))) {
+        return false;
+    }
+    *time = sample.time;
     return true;
 }
 
+// the log is read into this buffer in one transaction, only when someone asks for it
+static uint8_t log_image[LOG_SIZE];
+
+bool EEPROM::openLog(JournalCursor &cursor) {
+    return log_journal.open(cursor, log_image);
+}
+
 void EEPROM::printAllLogs() {
     printf("\n--EEPROM Log--\n");
 
-    for (uint16_t i = MIN_LOG_ADDR; i <= MAX_LOG_ADDRESS; i += STR_BUFFER_SIZE) {
-        std::vector<uint8_t> read_data(STR_BUFFER_SIZE);
-
-        if (eepromRead(i, read_data.data(), STR_BUFFER_SIZE)) {
-            if (read_data[0] != 0) {
-                size_t message_len = 0;
-                while (message_len < STR_BUFFER_SIZE && read_data[message_len] != '\0') {
-                    message_len++;
-                }
-
-                if (validateCrc(read_data.data(), message_len)) {
-                    char *message_read = reinterpret_cast<char *>(read_data.data());
-                    printf("Log [0x%04X]: %s\n", i, message_read);
-                } else {
-                    printf("Log [0x%04X]: CRC validation failed\n", i);
-                }
-            }
-        } else {
-            printf("Failed to read from address 0x%04X\n", i);
-            break;
+    JournalCursor cursor;
+    if (!openLog(cursor)) {
+        printf("Log read failed\n");
+        return;
+    }
+    while (cursor.next()) {
+        EventRecord record;
+        std::memcpy(&record, cursor.payload(), sizeof(record));
+        printf("Log [0x%04X] #%u t=%lu z%u: %s (%u)\n", cursor.address(), cursor.seq(), record.time,
+               record.zone, event_name(record.code), record.value);
+    }
+}
+
+void EEPROM::dumpLogs() {
+    JournalCursor cursor;
+    if (!openLog(cursor)) {
+        printf("Log read failed\n");
+        return;
+    }
+    while (cursor.next()) {
+        printf("EV %04X %04X ", cursor.address(), cursor.seq());
+        for (size_t i = 0; i < sizeof(EventRecord); i++) {
+            printf("%02X", cursor.payload()[i]);
         }
+        printf("\n");
     }
 }
 
 void EEPROM::deleteLogs() {
-    uint8_t zero = 0;
-    for (uint16_t i = MIN_LOG_ADDR; i <= MAX_LOG_ADDRESS; i += STR_BUFFER_SIZE) {
-        eepromWrite(i, &zero, 1);
-    }
-    writeLogAddress(MIN_LOG_ADDR);
+    log_epoch++;
+    storeEpochs();
+    log_journal.clear(log_epoch);
     printf("All logs deleted\n");
-}
\ No newline at end of file
+}
+
+bool EEPROM::erase() {
+    device_epoch++;
+    log_epoch++;
+    if (!storeEpochs()) {
+        return false;
+    }
+    log_journal.clear(log_epoch);
+    for (uint8_t key = 0; key < SETTING_COUNT; key++) {
+        setting_rings[key].clear(device_epoch);
+        setting_known[key] = false;
+    }
+    sample_journal.clear(device_epoch);
+    sample_cursor_known = false;
+    printf("EEPROM erased, epoch %u\n", device_epoch);
+    return true;
+}
+
+bool EEPROM::scrub() {
+    if (log_journal.scrub()) return true;
+    for (auto &ring: setting_rings) {
+        if (ring.scrub()) return true;
+    }
+    return sample_journal.scrub();
+}
+
+bool EEPROM::storeEpochs() {
+    uint8_t payload[SETTING_SLOT_SIZE - JOURNAL_OVERHEAD] = {
+        static_cast<uint8_t>(device_epoch & 0xFF), static_cast<uint8_t>(device_epoch >> 8),
+        static_cast<uint8_t>(log_epoch & 0xFF), static_cast<uint8_t>(log_epoch >> 8)
+    };
+    return epoch_ring.append(payload, sizeof(payload));
+}
@@ -6,14 +6,20 @@
 #include <cstring>
 #include <string>
 #include <memory>
+#include "Journal.h"
+#include "EventLog.h"
+#include "Sample.h"
 
 #define EEPROM_ADDRESS 0x50
+#define EEPROM_PAGE_SIZE 64
+// write cycle is 5 ms max, polling gives up after this
+#define EEPROM_WRITE_TIMEOUT_US 10000
 #define STATUS_BUFF_SIZE 8 // for status updates
 #define STR_BUFFER_SIZE 64 //for log messages
 #define STATUS_MSG_COUNT 3
 
  // 5 addresses saved for status updates like co2_set val or reboot detect
-//addresses for specific status updates
+//addresses for specific status updates, legacy: only read once to migrate to the config block
 #define REBOOT_ADDR 0x00
 #define REBOOT_FLAG "REBOOT"
 #define RUN_FLAG "RUN"
@@ -21,44 +27,155 @@
 #define CO2_SET_ADDR 0x08
 #define FAN_SPEED_ADDR 0x10
 
-#define LOG_COUNT 10 // max log messages until log entries are deleted
-
 //address for saving wifi credentials
 #define WIFI_SSID_ADDR 0x40
 #define WIFI_PASS_ADDR 0x80
 
-#define MIN_LOG_ADDR (WIFI_PASS_ADDR + STR_BUFFER_SIZE)
-#define MAX_LOG_ADDRESS (MIN_LOG_ADDR + (LOG_COUNT - 1) * STR_BUFFER_SIZE)
-#define LOG_ADDR_STORAGE (MAX_LOG_ADDRESS + STR_BUFFER_SIZE)
+
+// compiled control rules: 2 byte length, 2 byte crc and the bytecode
+#define RULES_ADDR 0x0400
+#define RULES_SIZE 0x0400
+#define RULES_HEADER_SIZE 4
+
+// two warm restart snapshot slots
+#define SNAPSHOT_ADDR 0x0800
+#define SNAPSHOT_SLOT_SIZE 0x0100
+
+// typed configuration block (see Config), two slots written in turn
+#define CONFIG_ADDR 0x0A00
+#define CONFIG_SLOT_SIZE 0x0100
+
+// free area used by the write benchmark
+#define EEPROM_SCRATCH_ADDR 0x0100
+#define EEPROM_SCRATCH_SIZE 0x0100
+
+// settings that change often rotate over a ring of slots with sequence number and crc, see Journal.
+// A torn write only loses the newest slot, and every slot is written 1/SETTING_SLOTS as often
+#define SETTING_SLOT_SIZE 8
+#define SETTING_SLOTS 16
+#define CO2_SET_RING_ADDR 0x0200
+#define FAN_SPEED_RING_ADDR 0x0280
+// next sample the uplink hasn't confirmed
+#define SAMPLE_CURSOR_RING_ADDR 0x0380
+
+// erase epochs: device epoch (statuses, setting rings) and log epoch, in a ring like the settings.
+// Crcs are seeded with the epoch, so erasing is one epoch write and old records read as empty
+#define EPOCH_RING_ADDR 0x0300
+
+// event log, binary records packed 5 per page, the oldest entry is overwritten when full
+#define LOG_ADDR 0x1000
+#define LOG_SIZE 0x1000
+#define LOG_COUNT ((LOG_SIZE / EEPROM_PAGE_SIZE) * (EEPROM_PAGE_SIZE / EVENT_SLOT_SIZE))
+
+// samples waiting for the uplink, 3 per page, about 6 hours at one sample per 20 s
+#define SAMPLE_ADDR 0x2000
+#define SAMPLE_SIZE 0x6000
+#define SAMPLE_COUNT ((SAMPLE_SIZE / EEPROM_PAGE_SIZE) * (EEPROM_PAGE_SIZE / SAMPLE_SLOT_SIZE))
+
+enum SettingKey : uint8_t {
+    SETTING_CO2_SET,    // co2 set level of zone 0, changed from UI and cloud so it has its own ring
+    SETTING_FAN_SPEED,
+    SETTING_SAMPLE_CURSOR,
+    SETTING_COUNT
+};
 
 class EEPROM {
 public:
     EEPROM(std::shared_ptr<PicoI2C> i2cbus, uint8_t address = EEPROM_ADDRESS);
+    // loads the erase epochs, called once before anything else is read or written
+    bool begin();
 
     // single status updates
     bool writeStatus(uint16_t address, const char *status, size_t max_len = STATUS_BUFF_SIZE);
     bool readStatus(uint16_t address, char *status_buffer, size_t buffer_len, size_t max_len = STATUS_BUFF_SIZE);
     bool readStatus(uint16_t address, std::string &status_buffer, size_t max_len = STATUS_BUFF_SIZE);
 
+    // settings in rotating slots, a write of an unchanged value is skipped
+    bool writeSetting(SettingKey key, uint16_t value);
+    bool readSetting(SettingKey key, uint16_t *value);
+
+    // samples for the uplink: appended every round, read oldest first and confirmed in batches.
+    // When the uplink falls a whole buffer behind the oldest samples are overwritten
+    bool appendSample(const SampleRecord &sample);
+    // copies up to max of the oldest unconfirmed samples, returns how many
+    uint16_t peekSamples(SampleRecord *samples, uint16_t max);
+    // confirms the count oldest samples with one cursor write
+    bool ackSamples(uint16_t count);
+    void sampleStats(SampleStats *stats);
+
     // functions for logging
-    bool writeLog(const char *message);
+    bool logEvent(EventCode code, uint8_t zone = 0, uint16_t value = 0);
+    // time of the newest logged event, false if the log is empty
+    bool lastEventTime(uint32_t *time);
+    // time of the newest stored sample, false if there are none
+    bool lastSampleTime(uint32_t *time);
+    // cursor over the whole log, read with one transaction into a buffer that is reused
+    bool openLog(JournalCursor &cursor);
     void printAllLogs();
+    // raw records as hex, one per line, for tools/eventlog/decode_events.py
+    void dumpLogs();
     void deleteLogs();
-    bool isLogEmpty(uint16_t *next_addr);
+    // logical erase of statuses, settings and log
+    bool erase();
+    // zeroes one page left over from an erase, false when there is nothing left to clean
+    bool scrub();
 
-    // direct access functions
+    // direct access functions. Writes may span pages, they are collected into a page buffer
+    // and written when another page is touched, before a read, or on flush()
     bool eepromWrite(uint16_t address, const uint8_t *data, size_t data_len);
     bool eepromRead(uint16_t address, uint8_t *data, size_t data_len);
+    bool flush();
+    // flush and wait until the chip has finished writing
+    bool sync();
+
+    void printStats();
+    // writes the scratch area in log sized records and prints the throughput
+    void benchmark();
+
+    static uint16_t crc16(const uint8_t *buffer_p, size_t buffer_len, uint16_t crc = 0xFFFF);
+    // crc start value of records written in an epoch, epoch 0 is the plain crc
+    static uint16_t epochSeed(uint16_t epoch);
+    // fills the length and crc in front of a rule program that is at image + RULES_HEADER_SIZE
+    static void rulesHeader(uint8_t *image, size_t len);
 
 private:
     std::shared_ptr<PicoI2C> i2c;
     uint8_t addr;
 
-    // private functions for crc check and log address update
-    uint16_t crc16(const uint8_t *buffer_p, size_t buffer_len);
+    // event records in a journal, head of the journal is kept in RAM
+    Journal log_journal;
+    Journal setting_rings[SETTING_COUNT];
+    uint16_t setting_values[SETTING_COUNT] = {};
+    bool setting_known[SETTING_COUNT] = {};
+    Journal epoch_ring;
+    Journal sample_journal;
+    uint16_t sample_cursor = 0;
+    bool sample_cursor_known = false;
+    uint32_t sample_overflows = 0;  // samples overwritten before they were sent
+    uint16_t sample_high_water = 0; // most samples waiting at once
+    uint16_t device_epoch = 0;
+    uint16_t log_epoch = 0;
+
+    // private functions for crc check
     bool validateCrc(const uint8_t *data_buffer, size_t message_len);
-    uint16_t readLogAddress();
-    bool writeLogAddress(uint16_t log_addr);
+    bool storeEpochs();
+    bool loadSampleCursor();
+
+    bool stage(uint16_t address, const uint8_t *data, size_t data_len);
+    bool waitReady();
+
+    // address word followed by the bytes waiting to be written, all within one page
+    uint8_t page_buffer[EEPROM_PAGE_SIZE + 2];
+    uint16_t pending_addr = 0;
+    size_t pending_len = 0;
+    bool write_cycle = false;   // chip is busy with the last page write
+    uint32_t write_start_us = 0;
+
+    // write statistics
+    uint32_t bytes_written = 0;
+    uint32_t page_writes = 0;
+    uint32_t ack_polls = 0;
+    uint64_t busy_us = 0;       // from page write start until the chip acks again
 };
 
 #endif // EEPROM_H
\ No newline at end of file
@@ -0,0 +1,23 @@
+#include "EventLog.h"
+
+static const char *const event_names[EV_COUNT] = {
+    "none",
+    "First system start",
+    "Normal system start",
+    "Unexpected system shutdown",
+    "Warm restart",
+    "co2 measured",
+    "co2 measure failed",
+    "T&RH measured",
+    "T&RH measure failed",
+    "valve open",
+    "valve closed",
+    "Fan failed",
+    "Fan speed diverged",
+    "co2 set changed",
+    "Rules stored",
+};
+
+const char *event_name(uint8_t code) {
+    return code < EV_COUNT ? event_names[code] : "unknown";
+}
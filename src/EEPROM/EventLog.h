@@ -0,0 +1,41 @@
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include <cstdint>
+
+// Binary event records kept in the log journal. A slot is 12 bytes:
+// [seq 2][code 1][zone 1][value 2][time 4][crc 2], multi-byte fields little endian
+// except crc. tools/eventlog/decode_events.py reads this table to decode raw dumps,
+// so keep one code per line in the form EV_NAME = number, // description
+enum EventCode : uint8_t {
+    EV_NONE = 0,             // unused
+    EV_FIRST_START = 1,      // first system start
+    EV_NORMAL_START = 2,     // normal system start
+    EV_UNEXPECTED_START = 3, // start after unexpected shutdown
+    EV_WARM_RESTART = 4,     // control state restored from snapshot, value = snapshot seq
+    EV_CO2_MEASURED = 5,     // value = co2 ppm
+    EV_CO2_FAILED = 6,       // co2 measure failed
+    EV_TRH_MEASURED = 7,     // value = RH in 0.1 %
+    EV_TRH_FAILED = 8,       // T&RH measure failed
+    EV_VALVE_OPEN = 9,       // value = number of valves opened
+    EV_VALVE_CLOSED = 10,    // valves closed
+    EV_FAN_FAILED = 11,      // fan not running, value = commanded speed %
+    EV_FAN_DIVERGED = 12,    // fan had a different speed than commanded, value = commanded speed %
+    EV_CO2_SET_CHANGED = 13, // value = new co2 set level
+    EV_RULES_STORED = 14,    // value = rule count
+    EV_COUNT
+};
+
+#define EVENT_SLOT_SIZE 12
+
+struct EventRecord {
+    uint8_t code;
+    uint8_t zone;
+    uint16_t value;
+    uint32_t time;      // DeviceTime seconds
+};
+static_assert(sizeof(EventRecord) == EVENT_SLOT_SIZE - 4, "event record must fit the journal slot");
+
+const char *event_name(uint8_t code);
+
+#endif //EVENTLOG_H
@@ -0,0 +1,216 @@
+#include "Journal.h"
+#include "EEPROM.h"
+
+Journal::Journal(EEPROM &eeprom, uint16_t base, uint16_t slot_size, uint16_t slot_count) :
+    eeprom(eeprom), base(base), slot_size(slot_size), slot_count(slot_count),
+    per_page(EEPROM_PAGE_SIZE / slot_size) {}
+
+uint16_t Journal::payload_size() const {
+    return slot_size - JOURNAL_OVERHEAD;
+}
+
+uint16_t Journal::slot_address(uint16_t slot) const {
+    return base + (slot / per_page) * EEPROM_PAGE_SIZE + (slot % per_page) * slot_size;
+}
+
+uint16_t Journal::span() const {
+    return slot_address(slot_count - 1) + slot_size - base;
+}
+
+bool Journal::check_slot(const uint8_t *buffer, uint16_t *seq) const {
+    uint16_t stored_crc = (buffer[slot_size - 2] << 8) | buffer[slot_size - 1];
+    if (record_crc(buffer) != stored_crc) {
+        return false;
+    }
+    *seq = buffer[0] | (buffer[1] << 8);
+    return true;
+}
+
+// reads a slot, false if it is empty or fails crc
+bool Journal::read_slot(uint16_t slot, uint8_t *buffer, uint16_t *seq) {
+    if (bulk) {
+        std::memcpy(buffer, bulk + slot_address(slot) - base, slot_size);
+    } else if (!eeprom.eepromRead(slot_address(slot), buffer, slot_size)) {
+        return false;
+    }
+    return check_slot(buffer, seq);
+}
+
+// Slot i holds seq(0) + i up to the newest record. After that the slots are either empty or
+// hold the previous lap, so the newest record is found with a binary search on that property.
+void Journal::find_head() {
+    uint8_t buffer[JOURNAL_MAX_SLOT];
+    uint16_t first_seq;
+    uint16_t seq;
+    head_known = true;
+
+    if (!read_slot(0, buffer, &first_seq)) {
+        // empty journal, or the first slot of a new lap was torn while writing
+        head = 0;
+        wrapped = read_slot(slot_count - 1, buffer, &seq);
+        next_seq = wrapped ? seq + 1 : 0;
+        return;
+    }
+
+    uint16_t lo = 0;            // known to be in the current lap
+    uint16_t hi = slot_count;   // first slot known not to be
+    while (hi - lo > 1) {
+        uint16_t mid = lo + (hi - lo) / 2;
+        if (read_slot(mid, buffer, &seq) && static_cast<uint16_t>(seq - first_seq) == mid) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    head = (lo + 1) % slot_count;
+    next_seq = first_seq + lo + 1;
+    // slot after the newest one holds an older record if the journal has wrapped
+    wrapped = head == 0 || read_slot(head, buffer, &seq);
+    printf("Journal 0x%04X: head slot %u, next seq %u\n", base, head, next_seq);
+}
+
+bool Journal::append(const uint8_t *payload, size_t len) {
+    if (!head_known) find_head();
+
+    uint8_t buffer[JOURNAL_MAX_SLOT] = {};
+    if (len > payload_size()) len = payload_size();
+    buffer[0] = next_seq & 0xFF;
+    buffer[1] = next_seq >> 8;
+    std::memcpy(buffer + 2, payload, len);
+    uint16_t crc = record_crc(buffer);
+    buffer[slot_size - 2] = crc >> 8;
+    buffer[slot_size - 1] = crc & 0xFF;
+
+    if (!eeprom.eepromWrite(slot_address(head), buffer, slot_size)) {
+        return false;
+    }
+    next_seq++;
+    head = (head + 1) % slot_count;
+    if (head == 0) wrapped = true;
+    return true;
+}
+
+// small journals are read whole, so finding the head and the newest record is one transaction
+bool Journal::newest(uint8_t *payload) {
+    uint8_t region[JOURNAL_BULK_MAX];
+    if (!head_known && span() <= sizeof(region) && eeprom.eepromRead(base, region, span())) {
+        bulk = region;
+    }
+    if (!head_known) find_head();
+
+    uint8_t buffer[JOURNAL_MAX_SLOT];
+    uint16_t seq;
+    bool found = (head != 0 || wrapped) && read_slot((head + slot_count - 1) % slot_count, buffer, &seq);
+    bulk = nullptr;
+    if (!found) {
+        return false;
+    }
+    std::memcpy(payload, buffer + 2, payload_size());
+    return true;
+}
+
+bool Journal::open(JournalCursor &cursor, uint8_t *image) {
+    if (!eeprom.eepromRead(base, image, span())) {
+        return false;
+    }
+    // the image also gives the head if it isn't known yet
+    bulk = image;
+    if (!head_known) find_head();
+    bulk = nullptr;
+
+    cursor.journal = this;
+    cursor.image = image;
+    cursor.first = wrapped ? head : 0;
+    cursor.count = wrapped ? slot_count : head;
+    cursor.pos = 0;
+    return true;
+}
+
+bool JournalCursor::next() {
+    while (pos < count) {
+        slot = (first + pos++) % journal->slot_count;
+        if (journal->check_slot(image + journal->slot_address(slot) - journal->base, &record_seq)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint16_t JournalCursor::address() const {
+    return journal->slot_address(slot);
+}
+
+uint16_t JournalCursor::seq() const {
+    return record_seq;
+}
+
+const uint8_t *JournalCursor::payload() const {
+    return image + journal->slot_address(slot) - journal->base + 2;
+}
+
+uint16_t Journal::next_sequence() {
+    if (!head_known) find_head();
+    return next_seq;
+}
+
+uint16_t Journal::stored() {
+    if (!head_known) find_head();
+    return wrapped ? slot_count : head;
+}
+
+bool Journal::read_seq(uint16_t seq, uint8_t *payload) {
+    uint16_t held = stored();
+    uint16_t back = next_seq - seq;
+    if (back == 0 || back > held) {
+        return false;
+    }
+    uint8_t buffer[JOURNAL_MAX_SLOT];
+    uint16_t slot_seq;
+    if (!read_slot((head + slot_count - back) % slot_count, buffer, &slot_seq) || slot_seq != seq) {
+        return false;
+    }
+    std::memcpy(payload, buffer + 2, payload_size());
+    return true;
+}
+
+uint16_t Journal::record_crc(const uint8_t *buffer) const {
+    return EEPROM::crc16(buffer, slot_size - 2, EEPROM::epochSeed(epoch));
+}
+
+void Journal::set_epoch(uint16_t new_epoch) {
+    epoch = new_epoch;
+    head_known = false;
+}
+
+void Journal::clear(uint16_t new_epoch) {
+    epoch = new_epoch;
+    head_known = true;
+    head = 0;
+    next_seq = 0;
+    wrapped = false;
+    scrubbing = true;
+    scrub_page = 1;
+}
+
+// Pages after the one the head is on only hold records of the old epoch until the journal
+// wraps. They don't read as valid, zeroing them just keeps a stale record from passing the
+// crc of the new epoch by chance
+bool Journal::scrub() {
+    if (!scrubbing) return false;
+
+    uint16_t pages = (slot_count + per_page - 1) / per_page;
+    uint16_t head_page = head / per_page;
+    if (scrub_page <= head_page) scrub_page = head_page + 1;
+    if (wrapped || scrub_page >= pages) {
+        scrubbing = false;
+        return false;
+    }
+
+    uint8_t zero_page[EEPROM_PAGE_SIZE] = {};
+    uint16_t page_start = scrub_page * EEPROM_PAGE_SIZE;
+    uint16_t page_len = span() - page_start < EEPROM_PAGE_SIZE ? span() - page_start : EEPROM_PAGE_SIZE;
+    eeprom.eepromWrite(base + page_start, zero_page, page_len);
+    scrub_page++;
+    return true;
+}
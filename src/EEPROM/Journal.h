@@ -0,0 +1,95 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <cstdint>
+#include <cstddef>
+
+class EEPROM;
+class Journal;
+
+// position in a journal image read by Journal::open, records come oldest first
+class JournalCursor {
+public:
+    // moves to the next valid record, false at the end
+    bool next();
+    uint16_t address() const;
+    uint16_t seq() const;
+    // slot_size - JOURNAL_OVERHEAD bytes
+    const uint8_t *payload() const;
+
+private:
+    friend class Journal;
+    const Journal *journal = nullptr;
+    const uint8_t *image = nullptr;
+    uint16_t first = 0;
+    uint16_t count = 0;
+    uint16_t pos = 0;
+    uint16_t slot = 0;
+    uint16_t record_seq = 0;
+};
+
+// bytes each slot uses for the sequence number and crc
+#define JOURNAL_OVERHEAD 4
+#define JOURNAL_MAX_SLOT 64
+// journals up to this size are scanned with one read when only the newest record is needed
+#define JOURNAL_BULK_MAX 256
+
+// Append-only circular journal of fixed size slots: [seq lo][seq hi][payload][crc hi][crc lo].
+// Slots are written in order and the sequence number grows by one per record, so the head
+// is found once by binary search and then kept in RAM. Nothing but the record is written.
+// Small slots are packed as many per eeprom page as fit, so no record straddles a page.
+// The crc is seeded with the journal's epoch: clearing bumps the epoch, which turns every old
+// record into an empty slot at once. The stale pages are zeroed later with scrub().
+class Journal {
+public:
+    Journal(EEPROM &eeprom, uint16_t base, uint16_t slot_size, uint16_t slot_count);
+
+    bool append(const uint8_t *payload, size_t len);
+    // reads the whole journal into image (span() bytes) in one transaction, the cursor starts
+    // before the oldest record
+    bool open(JournalCursor &cursor, uint8_t *image);
+    // copies the payload of the newest record, false if the journal is empty
+    bool newest(uint8_t *payload);
+    // sequence number the next record gets
+    uint16_t next_sequence();
+    // records held, the oldest is next_sequence() - stored()
+    uint16_t stored();
+    // copies the payload of the record with this sequence number, false if it isn't held
+    bool read_seq(uint16_t seq, uint8_t *payload);
+    // epoch in use, set once before the journal is used
+    void set_epoch(uint16_t new_epoch);
+    // starts over in a new epoch, nothing is written here
+    void clear(uint16_t new_epoch);
+    // zeroes one page of records left from an older epoch, false when there is nothing left
+    bool scrub();
+
+    uint16_t payload_size() const;
+    uint16_t slot_address(uint16_t slot) const;
+    // bytes from the first slot to the end of the last one
+    uint16_t span() const;
+
+private:
+    friend class JournalCursor;
+    bool check_slot(const uint8_t *buffer, uint16_t *seq) const;
+    bool read_slot(uint16_t slot, uint8_t *buffer, uint16_t *seq);
+    void find_head();
+    uint16_t record_crc(const uint8_t *buffer) const;
+
+    EEPROM &eeprom;
+    uint16_t base;
+    uint16_t slot_size;
+    uint16_t slot_count;
+    uint16_t per_page;     // slots in one eeprom page
+    const uint8_t *bulk = nullptr; // whole journal read into RAM, read_slot uses it when set
+
+    bool head_known = false;
+    uint16_t head = 0;     // slot the next record goes to
+    uint16_t next_seq = 0;
+    bool wrapped = false;  // all slots hold records
+
+    uint16_t epoch = 0;
+    bool scrubbing = false;
+    uint16_t scrub_page = 0; // next page to zero
+};
+
+#endif //JOURNAL_H
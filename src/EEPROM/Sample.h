@@ -0,0 +1,27 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+#include <cstdint>
+
+// one measurement round kept for the uplink, values as in ZoneState
+#define SAMPLE_SLOT_SIZE 18
+
+struct __attribute__((packed)) SampleRecord {
+    uint32_t time;          // DeviceTime seconds
+    uint16_t co2_val;
+    int16_t temperature;    // 0.1 C
+    uint16_t humidity;      // 0.1 %RH
+    uint16_t co2_set;
+    uint8_t fan_speed;
+    uint8_t zone;
+};
+static_assert(sizeof(SampleRecord) == SAMPLE_SLOT_SIZE - 4, "sample record must fit the journal slot");
+
+// state of the sample buffer for the uplink counters
+struct SampleStats {
+    uint16_t waiting;       // samples not confirmed yet
+    uint16_t high_water;    // most samples waiting at once
+    uint32_t dropped;       // samples overwritten before they were sent
+};
+
+#endif //SAMPLE_H
@@ -2,21 +2,27 @@
 
 // addresses are wire addresses (numbering starts from zero)
 Produal::Produal(std::shared_ptr<ModbusClient> client, int server_address)
-    :produal_speed(client,server_address,0,true), //A01, holding register (R&W), register address: 40001
+    :produal_speed(client,server_address,0), //A01, holding register (R&W), register address: 40001
     produal_pulse(client,server_address,4,false) //AL1 digital counter (Input register), register address: 30005
     {}
 
-//set the Speed of the fan
+//set the Speed of the fan, only goes on the bus if the speed changes
 void Produal::setSpeed(uint16_t speed){
-    if (speed < 0) speed = 0;
     if (speed > 100) speed = 100;
     produal_speed.write(speed * 10);
-    current_speed_in_percent = speed;
 }
 
-//return the speed of the fan saved in the system
+//return the commanded speed of the fan
 uint16_t Produal::getSpeed() const{
-    return current_speed_in_percent;
+    return produal_speed.read() / 10;
+}
+
+bool Produal::sync(){
+    return produal_speed.sync();
+}
+
+const ShadowRegister &Produal::speedRegister() const{
+    return produal_speed;
 }
 
 //get the pulse from the fan
@@ -2,6 +2,7 @@
 #define FAN_H
 
 #include "modbus/ModbusRegister.h"
+#include "modbus/ShadowRegister.h"
 
 class Produal{
 public:
@@ -10,11 +11,13 @@ public:
     void setSpeed(uint16_t value);
     uint16_t returnPulse();
     uint16_t getSpeed() const;
+    // keeps the fan in line with the commanded speed, false if it had drifted
+    bool sync();
+    const ShadowRegister &speedRegister() const;
 
 private:
-    ModbusRegister produal_speed;
+    ShadowRegister produal_speed;
     ModbusRegister produal_pulse;
-    int current_speed_in_percent = 0;
 };
 
 #endif //FAN_H
\ No newline at end of file
@@ -0,0 +1,346 @@
+#include "FlashHistory.h"
+#include <cstring>
+#include <cstdio>
+#include "task.h"
+#include "pico/flash.h"
+#include "EEPROM/EEPROM.h"
+
+// end of the firmware image in flash, from the linker script
+extern char __flash_binary_end;
+
+// flash operations run by flash_safe_execute, offsets are from the start of the flash
+struct FlashOp {
+    uint32_t offset;
+    const uint8_t *data;
+};
+
+static void flash_program_op(void *param) {
+    auto op = static_cast<const FlashOp *>(param);
+    flash_range_program(op->offset, op->data, FLASH_PAGE_SIZE);
+}
+
+static void flash_erase_op(void *param) {
+    auto op = static_cast<const FlashOp *>(param);
+    flash_range_erase(op->offset, FLASH_SECTOR_SIZE);
+}
+
+bool FlashHistory::begin(uint32_t *newest_time) {
+    uint32_t binary_end = reinterpret_cast<uintptr_t>(&__flash_binary_end) - XIP_BASE;
+    if (binary_end > HISTORY_FLASH_OFFSET) {
+        printf("History disabled: firmware ends at 0x%lx, inside the history partition\n", binary_end);
+        return false;
+    }
+    enabled = true;
+    std::memset(page, 0xFF, sizeof(page));
+
+    // the head sector is the one with the newest valid header, the index is built on the way
+    int newest = -1;
+    for (uint16_t sector = 0; sector < HISTORY_SECTORS; sector++) {
+        const HistoryRecord *header = flash_record(sector, 0);
+        if (!valid_header(*header)) {
+            sector_start[sector] = HISTORY_NO_TIME;
+            continue;
+        }
+        sector_start[sector] = first_time(sector);
+        if (newest < 0 || static_cast<int32_t>(header->time - sector_seq) > 0) {
+            newest = sector;
+            sector_seq = header->time;
+        }
+    }
+
+    if (newest < 0) {
+        // empty store, the first record starts sector 0
+        head_sector = HISTORY_SECTORS - 1;
+        head_slot = HISTORY_SECTOR_RECORDS;
+        ahead_erased = sector_blank(0);
+        printf("History: empty\n");
+        return false;
+    }
+
+    // records are programmed in order, so the head is after the last slot that isn't blank
+    head_sector = newest;
+    head_slot = HISTORY_SECTOR_RECORDS;
+    while (head_slot > 1 && flash_record(head_sector, head_slot - 1)->type == HISTORY_ERASED) {
+        head_slot--;
+    }
+    if (head_slot < HISTORY_SECTOR_RECORDS) {
+        // the page the head is on is programmed again with the earlier records in it
+        std::memcpy(page, flash_record(head_sector, head_slot / HISTORY_PAGE_RECORDS * HISTORY_PAGE_RECORDS),
+                    sizeof(page));
+    }
+    ahead_erased = sector_blank((head_sector + 1) % HISTORY_SECTORS);
+    printf("History: head sector %u slot %u, sector seq %lu\n", head_sector, head_slot, sector_seq);
+
+    // the newest record is at the end of the head sector, or of the one before it when the
+    // head sector only has its header yet
+    *newest_time = last_time(head_sector, head_slot);
+    if (*newest_time == HISTORY_NO_TIME) {
+        uint16_t previous = (head_sector + HISTORY_SECTORS - 1) % HISTORY_SECTORS;
+        if (sector_start[previous] != HISTORY_NO_TIME) {
+            *newest_time = last_time(previous, HISTORY_SECTOR_RECORDS);
+        }
+    }
+    return *newest_time != HISTORY_NO_TIME;
+}
+
+bool FlashHistory::appendSample(const SampleRecord &sample) {
+    HistoryRecord record;
+    record.type = HISTORY_SAMPLE;
+    record.zone = sample.zone;
+    record.aux = sample.fan_speed;
+    record.time = sample.time;
+    record.value[0] = sample.co2_val;
+    record.value[1] = sample.temperature;
+    record.value[2] = sample.humidity;
+    record.value[3] = sample.co2_set;
+    return append(record);
+}
+
+bool FlashHistory::appendEvent(EventCode code, uint8_t zone, uint16_t value, uint32_t time) {
+    HistoryRecord record = {};
+    record.type = HISTORY_EVENT;
+    record.zone = zone;
+    record.aux = code;
+    record.time = time;
+    record.value[0] = value;
+    return append(record);
+}
+
+bool FlashHistory::append(const HistoryRecord &record) {
+    if (!enabled) return false;
+    if (head_slot >= HISTORY_SECTOR_RECORDS && !start_sector()) return false;
+    put(record);
+    return true;
+}
+
+// adds a record to the page in RAM, a full page is programmed at once
+void FlashHistory::put(const HistoryRecord &record) {
+    HistoryRecord &slot = page[head_slot % HISTORY_PAGE_RECORDS];
+    slot = record;
+    slot.check = record_check(slot);
+    if (head_slot == 1) sector_start[head_sector] = record.time;
+    if (!page_dirty) {
+        page_dirty = true;
+        dirty_since = xTaskGetTickCount();
+    }
+    head_slot++;
+    if (head_slot % HISTORY_PAGE_RECORDS == 0) {
+        program_page();
+    }
+}
+
+// moves the head to the sector erased ahead, the sector after it holds the oldest records
+// and is erased by the next maintain(). False if the sector couldn't be erased
+bool FlashHistory::start_sector() {
+    uint16_t next = (head_sector + 1) % HISTORY_SECTORS;
+    if (!ahead_erased && !erase_sector(next)) {
+        return false;
+    }
+    head_sector = next;
+    head_slot = 0;
+    sector_start[next] = HISTORY_NO_TIME;
+    ahead_erased = false;
+    std::memset(page, 0xFF, sizeof(page));
+
+    HistoryRecord header = {};
+    header.type = HISTORY_SECTOR;
+    header.time = ++sector_seq;
+    header.value[0] = HISTORY_MAGIC;
+    put(header);
+    return true;
+}
+
+// Programming only clears bits, so a partly filled page can be programmed again later with
+// more records added: the slots programmed before get the same bytes again
+void FlashHistory::program_page() {
+    uint16_t index = (head_slot - 1) / HISTORY_PAGE_RECORDS;
+    FlashOp op = {HISTORY_FLASH_OFFSET + head_sector * FLASH_SECTOR_SIZE + index * FLASH_PAGE_SIZE,
+                  reinterpret_cast<const uint8_t *>(page)};
+    if (flash_safe_execute(flash_program_op, &op, HISTORY_SAFE_TIMEOUT_MS) == PICO_OK) {
+        page_programs++;
+    } else {
+        // a full page is dropped from RAM below, its records are lost
+        flash_failures++;
+    }
+    page_dirty = false;
+    if (head_slot % HISTORY_PAGE_RECORDS == 0) {
+        std::memset(page, 0xFF, sizeof(page));
+    }
+}
+
+// interrupts stay off for the whole erase, typically 45 ms
+bool FlashHistory::erase_sector(uint16_t sector) {
+    FlashOp op = {HISTORY_FLASH_OFFSET + sector * FLASH_SECTOR_SIZE, nullptr};
+    if (flash_safe_execute(flash_erase_op, &op, HISTORY_SAFE_TIMEOUT_MS) != PICO_OK) {
+        flash_failures++;
+        return false;
+    }
+    sector_start[sector] = HISTORY_NO_TIME;
+    sector_erases++;
+    return true;
+}
+
+bool FlashHistory::sector_blank(uint16_t sector) const {
+    auto words = reinterpret_cast<const uint32_t *>(XIP_BASE + HISTORY_FLASH_OFFSET + sector * FLASH_SECTOR_SIZE);
+    for (size_t i = 0; i < FLASH_SECTOR_SIZE / sizeof(uint32_t); i++) {
+        if (words[i] != 0xFFFFFFFF) return false;
+    }
+    return true;
+}
+
+void FlashHistory::flush() {
+    if (enabled && page_dirty) program_page();
+}
+
+bool FlashHistory::maintain(bool may_erase) {
+    if (!enabled) return false;
+    if (!ahead_erased && may_erase) {
+        ahead_erased = erase_sector((head_sector + 1) % HISTORY_SECTORS);
+        return true;
+    }
+    if (page_dirty && xTaskGetTickCount() - dirty_since >= pdMS_TO_TICKS(HISTORY_FLUSH_MS)) {
+        program_page();
+        return true;
+    }
+    return false;
+}
+
+// the sector after the head is blank or about to be erased, the one after that is the oldest
+void FlashHistory::open(HistoryCursor &cursor) const {
+    cursor.history = this;
+    cursor.current = nullptr;
+    cursor.first_sector = (head_sector + 2) % HISTORY_SECTORS;
+    cursor.pos = 0;
+    cursor.end = enabled ? (HISTORY_SECTORS - 2) * HISTORY_SECTOR_RECORDS + head_slot : 0;
+    cursor.from = 0;
+    cursor.to = HISTORY_NO_TIME;
+}
+
+void FlashHistory::seek(HistoryCursor &cursor, uint32_t from, uint32_t to) const {
+    open(cursor);
+    cursor.from = from;
+    cursor.to = to;
+    if (!enabled) return;
+
+    // last sector, counted from the oldest, that starts at or before from. Sectors without
+    // records are only found before the written ones and count as starting at 0
+    uint16_t lo = 0;
+    uint16_t hi = HISTORY_SECTORS - 1;
+    while (hi - lo > 1) {
+        uint16_t mid = lo + (hi - lo) / 2;
+        if (index_time(mid) <= from) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // first record of that sector at or after from, blank slots read as the largest time
+    uint16_t sector = (cursor.first_sector + lo) % HISTORY_SECTORS;
+    if (sector_start[sector] == HISTORY_NO_TIME) {
+        cursor.pos = lo * HISTORY_SECTOR_RECORDS;
+        return;
+    }
+    uint16_t last = lo == HISTORY_SECTORS - 2 ? head_slot : HISTORY_SECTOR_RECORDS;
+    uint16_t first = 1;
+    while (first < last) {
+        uint16_t mid = first + (last - first) / 2;
+        if (record_at(sector, mid)->time < from) {
+            first = mid + 1;
+        } else {
+            last = mid;
+        }
+    }
+    cursor.pos = lo * HISTORY_SECTOR_RECORDS + first;
+}
+
+// index entry of a sector counted from the oldest one
+uint32_t FlashHistory::index_time(uint16_t position) const {
+    uint32_t time = sector_start[(head_sector + 2 + position) % HISTORY_SECTORS];
+    return time == HISTORY_NO_TIME ? 0 : time;
+}
+
+// time of the first valid record after the header, the slot after it may be torn
+uint32_t FlashHistory::first_time(uint16_t sector) const {
+    for (uint16_t slot = 1; slot < HISTORY_SECTOR_RECORDS; slot++) {
+        const HistoryRecord *record = flash_record(sector, slot);
+        if (record->type == HISTORY_ERASED) break;
+        if (record->check == record_check(*record)) return record->time;
+    }
+    return HISTORY_NO_TIME;
+}
+
+// time of the last valid record before slot end, the one programmed last may be torn
+uint32_t FlashHistory::last_time(uint16_t sector, uint16_t end) const {
+    for (uint16_t slot = end; slot > 1; slot--) {
+        const HistoryRecord *record = flash_record(sector, slot - 1);
+        if (record->type == HISTORY_ERASED) continue;
+        if (record->check == record_check(*record)) return record->time;
+    }
+    return HISTORY_NO_TIME;
+}
+
+bool FlashHistory::valid_header(const HistoryRecord &record) {
+    return record.type == HISTORY_SECTOR && record.value[0] == HISTORY_MAGIC && record.check == record_check(record);
+}
+
+// records on the page the head is on are read from RAM, they may not be programmed yet
+const HistoryRecord *FlashHistory::record_at(uint16_t sector, uint16_t slot) const {
+    if (sector == head_sector && slot / HISTORY_PAGE_RECORDS == head_slot / HISTORY_PAGE_RECORDS) {
+        return &page[slot % HISTORY_PAGE_RECORDS];
+    }
+    return flash_record(sector, slot);
+}
+
+const HistoryRecord *FlashHistory::flash_record(uint16_t sector, uint16_t slot) {
+    return reinterpret_cast<const HistoryRecord *>(XIP_BASE + HISTORY_FLASH_OFFSET + sector * FLASH_SECTOR_SIZE +
+                                                   slot * HISTORY_RECORD_SIZE);
+}
+
+uint8_t FlashHistory::record_check(const HistoryRecord &record) {
+    auto bytes = reinterpret_cast<const uint8_t *>(&record);
+    uint16_t crc = EEPROM::crc16(bytes, 3);
+    return EEPROM::crc16(bytes + 4, HISTORY_RECORD_SIZE - 4, crc) & 0xFF;
+}
+
+void FlashHistory::printStats() const {
+    if (!enabled) {
+        printf("History: disabled\n");
+        return;
+    }
+    printf("History: sector %u slot %u, sector seq %lu, %lu page programs, %lu sector erases, %lu failed\n",
+           head_sector, head_slot, sector_seq, page_programs, sector_erases, flash_failures);
+}
+
+bool HistoryCursor::next() {
+    while (pos < end) {
+        uint16_t sector = (first_sector + pos / HISTORY_SECTOR_RECORDS) % HISTORY_SECTORS;
+        uint16_t slot = pos % HISTORY_SECTOR_RECORDS;
+        const HistoryRecord *record = history->record_at(sector, slot);
+        if (slot == 0) {
+            // sectors without a valid header were never written or are being erased
+            pos += FlashHistory::valid_header(*record) ? 1 : HISTORY_SECTOR_RECORDS;
+            continue;
+        }
+        if (record->type == HISTORY_ERASED) {
+            // rest of the sector is blank
+            pos += HISTORY_SECTOR_RECORDS - slot;
+            continue;
+        }
+        pos++;
+        if (record->check != FlashHistory::record_check(*record) || record->time < from) {
+            continue;
+        }
+        if (record->time > to) {
+            pos = end;
+            return false;
+        }
+        current = record;
+        return true;
+    }
+    return false;
+}
+
+const HistoryRecord &HistoryCursor::record() const {
+    return *current;
+}
@@ -0,0 +1,125 @@
+#ifndef FLASHHISTORY_H
+#define FLASHHISTORY_H
+
+#include <cstdint>
+#include <cstddef>
+#include "FreeRTOS.h"
+#include "hardware/flash.h"
+#include "EEPROM/Sample.h"
+#include "EEPROM/EventLog.h"
+
+// Partition at the top of the 2 MB QSPI flash, the firmware image must end below it
+#define HISTORY_FLASH_SIZE (1024 * 1024)
+#define HISTORY_FLASH_OFFSET (PICO_FLASH_SIZE_BYTES - HISTORY_FLASH_SIZE)
+#define HISTORY_RECORD_SIZE 16
+#define HISTORY_PAGE_RECORDS (FLASH_PAGE_SIZE / HISTORY_RECORD_SIZE)
+#define HISTORY_SECTOR_RECORDS (FLASH_SECTOR_SIZE / HISTORY_RECORD_SIZE)
+#define HISTORY_SECTORS (HISTORY_FLASH_SIZE / FLASH_SECTOR_SIZE)
+#define HISTORY_MAGIC 0x4853
+// a partly filled page is programmed after this long, bounds what a power cut loses
+#define HISTORY_FLUSH_MS (10 * 60 * 1000)
+// index entry of a sector without records
+#define HISTORY_NO_TIME 0xFFFFFFFF
+// how long flash_safe_execute may wait for the rest of the system to get out of the way
+#define HISTORY_SAFE_TIMEOUT_MS 100
+
+enum HistoryType : uint8_t {
+    HISTORY_SECTOR = 1, // first record of a sector: time = sector sequence, value[0] = magic
+    HISTORY_SAMPLE = 2, // aux = fan speed, value = co2, temperature, humidity, co2 set
+    HISTORY_EVENT = 3,  // aux = event code, value[0] = event value
+    HISTORY_ERASED = 0xFF
+};
+
+struct HistoryRecord {
+    uint8_t type;
+    uint8_t zone;
+    uint8_t aux;
+    uint8_t check;      // low byte of the crc of the other bytes
+    uint32_t time;      // DeviceTime seconds
+    uint16_t value[4];
+};
+static_assert(sizeof(HistoryRecord) == HISTORY_RECORD_SIZE, "history record size");
+
+class FlashHistory;
+
+// walks the history oldest first, records are read in place through the XIP window.
+// The cursor is a few words with no buffer, so a reader can keep it between batches
+class HistoryCursor {
+public:
+    // moves to the next valid record in the time range, false at the end
+    bool next();
+    const HistoryRecord &record() const;
+
+private:
+    friend class FlashHistory;
+    const FlashHistory *history = nullptr;
+    const HistoryRecord *current = nullptr;
+    uint32_t pos = 0;       // record position from the start of the oldest sector
+    uint32_t end = 0;
+    uint16_t first_sector = 0;
+    uint32_t from = 0;
+    uint32_t to = HISTORY_NO_TIME;
+};
+
+// Log-structured store of samples and events, much larger than the EEPROM journals.
+// Records are gathered in a RAM page and programmed a whole 256 byte page at a time, each
+// sector starts with a header carrying a sequence number so the head is found at boot by
+// reading the sector headers. The sector after the head is kept erased ahead of time by
+// maintain(), so the oldest sector is dropped when idle and not when a page is due.
+// Flash is written through flash_safe_execute, code can't run from flash meanwhile and
+// interrupts stay off on this core: about 1 ms for a page but 45 ms for a sector erase,
+// so the caller of maintain() says when an erase wouldn't hold up other traffic.
+// Reads go straight through the memory mapped XIP window.
+// Timestamps never go backwards, so a time range is found with a binary search: first over
+// a RAM index holding the time of the first record of each sector, rebuilt at boot from
+// the sectors themselves, then over the records of one sector.
+class FlashHistory {
+public:
+    // finds the head, disables the store if the firmware reaches into the partition.
+    // False if the store holds no records, else newest_time is the time of the newest one
+    bool begin(uint32_t *newest_time);
+    bool appendSample(const SampleRecord &sample);
+    bool appendEvent(EventCode code, uint8_t zone, uint16_t value, uint32_t time);
+    // programs the partly filled page
+    void flush();
+    // erase ahead, if may_erase, and timed flush, called when the storage task is idle.
+    // True if it did work
+    bool maintain(bool may_erase);
+    // the cursor starts before the oldest record
+    void open(HistoryCursor &cursor) const;
+    // the cursor starts before the first record at or after from and stops after to
+    void seek(HistoryCursor &cursor, uint32_t from, uint32_t to) const;
+    void printStats() const;
+
+private:
+    friend class HistoryCursor;
+    bool append(const HistoryRecord &record);
+    void put(const HistoryRecord &record);
+    bool start_sector();
+    void program_page();
+    bool erase_sector(uint16_t sector);
+    bool sector_blank(uint16_t sector) const;
+    uint32_t first_time(uint16_t sector) const;
+    uint32_t last_time(uint16_t sector, uint16_t end) const;
+    uint32_t index_time(uint16_t position) const;
+    const HistoryRecord *record_at(uint16_t sector, uint16_t slot) const;
+    static uint8_t record_check(const HistoryRecord &record);
+    static bool valid_header(const HistoryRecord &record);
+    static const HistoryRecord *flash_record(uint16_t sector, uint16_t slot);
+
+    bool enabled = false;
+    uint16_t head_sector = 0;
+    uint16_t head_slot = HISTORY_SECTOR_RECORDS; // next free slot, a full sector starts a new one
+    uint32_t sector_seq = 0;
+    bool ahead_erased = false;  // sector after the head is blank
+    HistoryRecord page[HISTORY_PAGE_RECORDS];  // page the head is on
+    bool page_dirty = false;    // page holds records not yet programmed
+    TickType_t dirty_since = 0;
+    uint32_t sector_start[HISTORY_SECTORS];     // time of the first record of each sector
+
+    uint32_t page_programs = 0;
+    uint32_t sector_erases = 0;
+    uint32_t flash_failures = 0;
+};
+
+#endif //FLASHHISTORY_H
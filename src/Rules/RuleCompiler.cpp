@@ -0,0 +1,211 @@
+#include "RuleCompiler.h"
+
+#include <cctype>
+#include <cstring>
+
+size_t RuleCompiler::compile(const char *source, uint8_t *program, size_t max_len) {
+    src = source;
+    out = program;
+    out_max = max_len;
+    out_len = 0;
+    timers = 0;
+    line = 1;
+    err = nullptr;
+    err_line = 0;
+
+    next();
+    while (tok != T_END) {
+        if (tok == T_SEP) {
+            next();
+            continue;
+        }
+        if (!rule()) return 0;
+    }
+    if (!emit(OP_END)) return 0;
+    return out_len;
+}
+
+const char *RuleCompiler::error() const {
+    return err;
+}
+
+int RuleCompiler::error_line() const {
+    return err_line;
+}
+
+bool RuleCompiler::fail(const char *message) {
+    if (!err) {
+        err = message;
+        err_line = line;
+    }
+    return false;
+}
+
+bool RuleCompiler::emit(uint8_t byte) {
+    if (out_len >= out_max) return fail("program too long");
+    out[out_len++] = byte;
+    return true;
+}
+
+bool RuleCompiler::expect(Token t, const char *what) {
+    if (tok != t) return fail(what);
+    next();
+    return true;
+}
+
+// lexer: reads the next token from src
+void RuleCompiler::next() {
+    while (*src == ' ' || *src == '\t' || *src == '\r' || *src == '#') {
+        if (*src == '#') {
+            while (*src && *src != '\n') src++;
+        } else {
+            src++;
+        }
+    }
+
+    char c = *src;
+    if (c == '\0') {
+        tok = T_END;
+    } else if (c == '\n' || c == ';') {
+        if (c == '\n') line++;
+        src++;
+        tok = T_SEP;
+    } else if (isdigit(c) || (c == '-' && isdigit(src[1]))) {
+        // numbers are kept in tenths, one decimal is significant
+        bool negative = c == '-';
+        if (negative) src++;
+        int32_t v = 0;
+        while (isdigit(*src)) {
+            v = v * 10 + (*src++ - '0');
+            if (v > 100000) break;
+        }
+        v *= 10;
+        if (*src == '.') {
+            src++;
+            if (isdigit(*src)) v += *src - '0';
+            while (isdigit(*src)) src++;
+        }
+        value = negative ? -v : v;
+        tok = T_NUM;
+    } else if (isalpha(c)) {
+        static const struct {
+            const char *word;
+            Token token;
+            int32_t value;
+        } keywords[] = {
+            {"co2", T_CH, CH_CO2}, {"temp", T_CH, CH_TEMP}, {"rh", T_CH, CH_RH},
+            {"set", T_CH, CH_SET}, {"max", T_CH, CH_MAX}, {"fan", T_FAN, CH_FAN},
+            {"when", T_WHEN, 0}, {"for", T_FOR, 0}, {"then", T_THEN, 0},
+            {"and", T_AND, 0}, {"or", T_OR, 0}, {"not", T_NOT, 0}, {"nodose", T_NODOSE, 0},
+        };
+        const char *start = src;
+        while (isalnum(*src)) src++;
+        size_t n = src - start;
+        tok = T_BAD;
+        for (const auto &k: keywords) {
+            if (strlen(k.word) == n && strncmp(k.word, start, n) == 0) {
+                tok = k.token;
+                value = k.value;
+                break;
+            }
+        }
+    } else if (c == '(' || c == ')') {
+        src++;
+        tok = c == '(' ? T_LPAR : T_RPAR;
+    } else if (c == '<' || c == '>' || c == '=' || c == '!') {
+        bool eq = src[1] == '=';
+        src += eq ? 2 : 1;
+        tok = T_CMP;
+        if (c == '<') value = eq ? OP_LE : OP_LT;
+        else if (c == '>') value = eq ? OP_GE : OP_GT;
+        else if (c == '=' && eq) value = OP_EQ;
+        else if (c == '!' && eq) value = OP_NE;
+        else tok = T_BAD;
+    } else {
+        src++;
+        tok = T_BAD;
+    }
+}
+
+// when <expr> [for <seconds>] then <action>
+bool RuleCompiler::rule() {
+    if (!expect(T_WHEN, "rule must start with 'when'")) return false;
+    if (!expr()) return false;
+
+    if (tok == T_FOR) {
+        next();
+        if (tok != T_NUM || value < 0 || value / 10 > 0xFFFF) return fail("expected seconds after 'for'");
+        if (timers >= RULE_TIMER_COUNT) return fail("too many 'for' rules");
+        int32_t seconds = value / 10;
+        if (!emit(OP_HOLD) || !emit(timers++) || !emit(seconds & 0xFF) || !emit(seconds >> 8)) return false;
+        next();
+    }
+
+    if (!expect(T_THEN, "expected 'then'")) return false;
+
+    if (tok == T_FAN) {
+        next();
+        if (tok != T_NUM || value < 0 || value > 1000) return fail("fan speed must be 0-100");
+        if (!emit(OP_FAN) || !emit(value / 10)) return false;
+        next();
+    } else if (tok == T_NODOSE) {
+        if (!emit(OP_NODOSE)) return false;
+        next();
+    } else {
+        return fail("expected action 'fan <speed>' or 'nodose'");
+    }
+
+    if (tok != T_SEP && tok != T_END) return fail("expected end of rule");
+    return true;
+}
+
+bool RuleCompiler::expr() {
+    if (!and_expr()) return false;
+    while (tok == T_OR) {
+        next();
+        if (!and_expr() || !emit(OP_OR)) return false;
+    }
+    return true;
+}
+
+bool RuleCompiler::and_expr() {
+    if (!unary()) return false;
+    while (tok == T_AND) {
+        next();
+        if (!unary() || !emit(OP_AND)) return false;
+    }
+    return true;
+}
+
+bool RuleCompiler::unary() {
+    if (tok == T_NOT) {
+        next();
+        return unary() && emit(OP_NOT);
+    }
+    if (tok == T_LPAR) {
+        next();
+        return expr() && expect(T_RPAR, "expected ')'");
+    }
+    // comparison
+    if (!operand()) return false;
+    if (tok != T_CMP) return fail("expected comparison");
+    auto op = static_cast<uint8_t>(value);
+    next();
+    return operand() && emit(op);
+}
+
+bool RuleCompiler::operand() {
+    if (tok == T_CH) {
+        if (!emit(OP_CH) || !emit(value)) return false;
+    } else if (tok == T_NUM) {
+        if (value < INT16_MIN || value > INT16_MAX) return fail("number out of range");
+        if (!emit(OP_CONST) || !emit(value & 0xFF) || !emit((value >> 8) & 0xFF)) return false;
+    } else if (tok == T_FAN) {
+        // 'fan' is also the fan speed channel
+        if (!emit(OP_CH) || !emit(CH_FAN)) return false;
+    } else {
+        return fail("expected channel or number");
+    }
+    next();
+    return true;
+}
@@ -0,0 +1,51 @@
+#ifndef RULECOMPILER_H
+#define RULECOMPILER_H
+
+#include <cstdint>
+#include <cstddef>
+#include "RuleEngine.h"
+
+// Compiles rule text into RuleEngine bytecode. One rule per line (or separated with ';'):
+//
+//   when <condition> [for <seconds>] then <action>
+//
+// condition: comparisons of channels (co2, temp, rh, fan, set, max) and numbers combined
+//            with and / or / not and parentheses, e.g. rh > 85.5 and temp > 18
+// action:    fan <speed %>   keep the fan at least at this speed while the condition holds
+//            nodose          don't open the co2 valve while the condition holds
+//
+// Text after '#' is a comment. Has no pico dependencies so it is also built into tools/rulec.
+class RuleCompiler {
+public:
+    // returns program length including the final OP_END, 0 on error (see error())
+    size_t compile(const char *source, uint8_t *program, size_t max_len);
+    const char *error() const;
+    int error_line() const;
+
+private:
+    enum Token { T_END, T_NUM, T_CH, T_WHEN, T_FOR, T_THEN, T_AND, T_OR, T_NOT, T_FAN, T_NODOSE,
+                 T_LPAR, T_RPAR, T_CMP, T_SEP, T_BAD };
+
+    void next();
+    bool expect(Token t, const char *what);
+    bool rule();
+    bool expr();
+    bool and_expr();
+    bool unary();
+    bool operand();
+    bool emit(uint8_t byte);
+    bool fail(const char *message);
+
+    const char *src = nullptr;
+    uint8_t *out = nullptr;
+    size_t out_max = 0;
+    size_t out_len = 0;
+    uint8_t timers = 0;
+    int line = 1;
+    Token tok = T_END;
+    int32_t value = 0;   // number (in tenths), channel or compare opcode of current token
+    const char *err = nullptr;
+    int err_line = 0;
+};
+
+#endif //RULECOMPILER_H
@@ -0,0 +1,154 @@
+#include "RuleEngine.h"
+
+#include <cstring>
+
+// operand bytes following each opcode
+static const uint8_t operand_len[OP_COUNT] = {
+    0, // OP_END
+    1, // OP_CH
+    2, // OP_CONST
+    0, 0, 0, 0, 0, 0, // compare
+    0, 0, 0, // AND, OR, NOT
+    3, // OP_HOLD
+    1, // OP_FAN
+    0, // OP_NODOSE
+};
+
+// checks opcodes, operands and stack depth once so that evaluate doesn't need to
+bool RuleEngine::verify(const uint8_t *program, size_t len, uint8_t *rules) {
+    size_t pc = 0;
+    int depth = 0;
+    uint8_t count = 0;
+
+    while (pc < len) {
+        uint8_t op = program[pc++];
+        if (op >= OP_COUNT || pc + operand_len[op] > len) return false;
+
+        switch (op) {
+            case OP_END:
+                if (depth != 0 || pc != len) return false;
+                if (rules) *rules = count;
+                return true;
+            case OP_CH:
+                if (program[pc] >= CH_COUNT) return false;
+                depth++;
+                break;
+            case OP_CONST:
+                depth++;
+                break;
+            case OP_NOT:
+                if (depth < 1) return false;
+                break;
+            case OP_HOLD:
+                if (depth < 1 || program[pc] >= RULE_TIMER_COUNT) return false;
+                break;
+            case OP_FAN:
+                if (depth != 1 || program[pc] > 100) return false;
+                depth = 0;
+                count++;
+                break;
+            case OP_NODOSE:
+                if (depth != 1) return false;
+                depth = 0;
+                count++;
+                break;
+            default:
+                // binary operators
+                if (depth < 2) return false;
+                depth--;
+                break;
+        }
+        if (depth > RULE_STACK_DEPTH) return false;
+        pc += operand_len[op];
+    }
+    // program must end with OP_END
+    return false;
+}
+
+bool RuleEngine::load(const uint8_t *program, size_t len) {
+    if (len == 0) {
+        code[0] = OP_END;
+        code_len = 0;
+        rules = 0;
+        return true;
+    }
+    uint8_t count = 0;
+    if (len > RULE_PROGRAM_MAX || !verify(program, len, &count)) {
+        return false;
+    }
+    std::memcpy(code, program, len);
+    code_len = len;
+    rules = count;
+    return true;
+}
+
+size_t RuleEngine::size() const {
+    return code_len;
+}
+
+uint8_t RuleEngine::rule_count() const {
+    return rules;
+}
+
+// runs the whole program once. Time is linear in program size as there are no jumps
+void RuleEngine::evaluate(const int32_t *inputs, RuleTimers &timers, uint32_t now_ms, RuleActions &actions) const {
+    int32_t stack[RULE_STACK_DEPTH];
+    int sp = 0;
+    size_t pc = 0;
+
+    actions = RuleActions{};
+
+    while (true) {
+        uint8_t op = code[pc++];
+        switch (op) {
+            case OP_END:
+                return;
+            case OP_CH:
+                stack[sp++] = inputs[code[pc++]];
+                break;
+            case OP_CONST:
+                stack[sp++] = static_cast<int16_t>(code[pc] | (code[pc + 1] << 8));
+                pc += 2;
+                break;
+            case OP_LT: sp--; stack[sp - 1] = stack[sp - 1] < stack[sp]; break;
+            case OP_LE: sp--; stack[sp - 1] = stack[sp - 1] <= stack[sp]; break;
+            case OP_GT: sp--; stack[sp - 1] = stack[sp - 1] > stack[sp]; break;
+            case OP_GE: sp--; stack[sp - 1] = stack[sp - 1] >= stack[sp]; break;
+            case OP_EQ: sp--; stack[sp - 1] = stack[sp - 1] == stack[sp]; break;
+            case OP_NE: sp--; stack[sp - 1] = stack[sp - 1] != stack[sp]; break;
+            case OP_AND: sp--; stack[sp - 1] = stack[sp - 1] && stack[sp]; break;
+            case OP_OR: sp--; stack[sp - 1] = stack[sp - 1] || stack[sp]; break;
+            case OP_NOT: stack[sp - 1] = !stack[sp - 1]; break;
+            case OP_HOLD: {
+                uint8_t timer = code[pc];
+                uint32_t hold_ms = (code[pc + 1] | (code[pc + 2] << 8)) * 1000u;
+                uint8_t bit = 1u << timer;
+                pc += 3;
+                if (stack[sp - 1]) {
+                    if (!(timers.running & bit)) {
+                        timers.running |= bit;
+                        timers.since[timer] = now_ms;
+                    }
+                    stack[sp - 1] = (now_ms - timers.since[timer]) >= hold_ms;
+                } else {
+                    timers.running &= ~bit;
+                }
+                break;
+            }
+            case OP_FAN:
+                if (stack[--sp] && code[pc] > actions.fan) {
+                    actions.fan = code[pc];
+                }
+                pc++;
+                break;
+            case OP_NODOSE:
+                if (stack[--sp]) {
+                    actions.block_dose = true;
+                }
+                break;
+            default:
+                // not reached, program was verified in load()
+                return;
+        }
+    }
+}
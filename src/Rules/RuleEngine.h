@@ -0,0 +1,73 @@
+#ifndef RULEENGINE_H
+#define RULEENGINE_H
+
+#include <cstdint>
+#include <cstddef>
+
+// Small stack machine for user defined control rules. Programs are produced by RuleCompiler
+// and verified when loaded, so evaluation has no loops, no allocation and a fixed worst case.
+// All values are integers in tenths (co2 700 ppm -> 7000, 21.5 C -> 215).
+
+#define RULE_PROGRAM_MAX 1020
+#define RULE_STACK_DEPTH 16
+#define RULE_TIMER_COUNT 8
+
+// input channels a rule can read
+enum RuleChannel : uint8_t {
+    CH_CO2,   // measured co2, ppm
+    CH_TEMP,  // temperature, C
+    CH_RH,    // relative humidity, %
+    CH_FAN,   // current fan speed, %
+    CH_SET,   // co2 set level, ppm
+    CH_MAX,   // co2 level that forces ventilation, ppm
+    CH_COUNT
+};
+
+enum RuleOp : uint8_t {
+    OP_END,     // end of program
+    OP_CH,      // [ch] push channel value
+    OP_CONST,   // [lo hi] push signed 16 bit constant
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+    OP_AND,
+    OP_OR,
+    OP_NOT,
+    OP_HOLD,    // [timer s_lo s_hi] true once the condition has been true for s seconds
+    OP_FAN,     // [speed] pop condition, if true ask for at least speed %
+    OP_NODOSE,  // pop condition, if true block co2 dosing
+    OP_COUNT
+};
+
+// what the rules asked for during one evaluation
+struct RuleActions {
+    int16_t fan = -1;   // minimum fan speed in %, -1 if no rule asked for it
+    bool block_dose = false;
+};
+
+// per zone state of the OP_HOLD timers
+struct RuleTimers {
+    uint32_t since[RULE_TIMER_COUNT];
+    uint8_t running;    // bit per timer
+};
+
+class RuleEngine {
+public:
+    // verifies and copies a compiled program, an empty program (len 0) disables rules
+    bool load(const uint8_t *program, size_t len);
+    void evaluate(const int32_t *inputs, RuleTimers &timers, uint32_t now_ms, RuleActions &actions) const;
+    size_t size() const;
+    uint8_t rule_count() const;
+
+    static bool verify(const uint8_t *program, size_t len, uint8_t *rules = nullptr);
+
+private:
+    uint8_t code[RULE_PROGRAM_MAX] = {OP_END};
+    size_t code_len = 0;
+    uint8_t rules = 0;
+};
+
+#endif //RULEENGINE_H
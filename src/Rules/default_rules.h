@@ -0,0 +1,11 @@
+#ifndef DEFAULT_RULES_H
+#define DEFAULT_RULES_H
+
+// Rules compiled and saved to EEPROM when there is no valid rule program in it. Other rules
+// are uploaded from the storage console with 'u', they replace the program without a reflash.
+// See RuleCompiler.h for the syntax, tools/rulec checks a rule file on the host. Examples:
+//   when rh > 85 for 120 then fan 40
+//   when fan > 0 then nodose
+static constexpr const char *default_rules = "";
+
+#endif //DEFAULT_RULES_H
@@ -6,11 +6,29 @@ HMP60::HMP60(std::shared_ptr<ModbusClient> client, int server_address):
 {}
 
 double HMP60::read_tem(){
-    temperature = ( temp_register.read()/10.0);
+    //temperature register is signed, below 0 C it reads as two's complement
+    temperature = ( static_cast<int16_t>(temp_register.read())/10.0);
     return temperature;
 }
 
 double HMP60::read_hum(){
     humidity = ( rh_register.read()/10.0);
     return humidity;
-}
\ No newline at end of file
+}
+
+bool HMP60::read_all(){
+    //RH and temperature are adjacent registers so one read covers both
+    uint16_t values[2] = {0, 0};
+    bool ok = rh_register.read(values, 2);
+    humidity = values[0]/10.0;
+    temperature = static_cast<int16_t>(values[1])/10.0;
+    return ok;
+}
+
+double HMP60::tem() const{
+    return temperature;
+}
+
+double HMP60::hum() const{
+    return humidity;
+}
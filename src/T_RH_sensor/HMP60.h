@@ -9,6 +9,10 @@ public:
 
     double read_tem();
     double read_hum();
+    // reads RH and temperature in one bus transaction, values are then returned by tem()/hum()
+    bool read_all();
+    double tem() const;
+    double hum() const;
 
 private:
     ModbusRegister rh_register;
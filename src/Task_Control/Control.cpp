@@ -1,11 +1,18 @@
 #include "Control.h"
+#include "Rules/RuleCompiler.h"
+#include "Rules/default_rules.h"
+#include "DeviceTime.h"
 
-Control::Control(SemaphoreHandle_t timer,
-    QueueHandle_t to_UI, QueueHandle_t to_Network, QueueHandle_t to_CO2,
+#include <cstddef>
+#include <cmath>
+
+Control::Control(QueueHandle_t to_UI, QueueHandle_t to_Network, QueueHandle_t to_CO2,
     EventGroupHandle_t network_event_group,
+    Storage &storage,
     uint32_t stack_size,
     UBaseType_t priority) :
-    timer_semphr(timer), to_UI(to_UI), to_Network(to_Network) ,to_CO2 (to_CO2),network_event_group(network_event_group){
+    cycle_timer(MEASURE_PERIOD_MS), to_UI(to_UI), to_Network(to_Network) ,to_CO2 (to_CO2),network_event_group(network_event_group),
+    storage(storage){
 
     xTaskCreate(task_wrap, name, stack_size, this, priority, nullptr);
 }
@@ -16,32 +23,31 @@ void Control::task_wrap(void *pvParameters) {
 }
 
 void Control::task_impl() {
+    // the Modbus bus is in use whenever the task is awake, history erases wait for it to sleep
+    storage.holdBus();
     // protocol initialization
     auto uart = std::make_shared<PicoOsUart>(UART_NR, UART_TX_PIN, UART_RX_PIN, BAUD_RATE, STOP_BITS);
     auto rtu_client = std::make_shared<ModbusClient>(uart);
     //auto i2cbus1 = std::make_shared<PicoI2C>(1, 100000); for pressure, but not used
-    auto i2cbus0 = std::make_shared<PicoI2C>(0, 100000);
-
-    // sensor objects
-    GMP252 co2(rtu_client, 240);
-    HMP60 tem_hum_sensor(rtu_client,241);
-    //SDP610 pressure_sensor(i2cbus0); // done but not used here
-
-    //actuators: valve and fan
-    Valve valve(27);
-    Produal fan(rtu_client, 1);
-
-    // EEPROM extern memory
-    eeprom = std::make_shared<EEPROM>(i2cbus0);
 
     // check last eeprom data
     rebooted = false;
     check_last_eeprom_data(&last_co2_set, &last_fan_speed, &rebooted, wifi_ssid, wifi_pass);
 
+    // sensors, fan and valve of every zone in the zone table
+    init_zones(rtu_client, last_co2_set);
+    load_rules();
+    // last samples, fan commands and valve lockouts from before the reboot
+    bool warm = restore_snapshot();
+
     if (rebooted) {
         printf("UNEXPECTED REBOOT\n");
 
-        fan.setSpeed(0);
+        if (!warm) {
+            for (uint z = 0; z < zone_count; z++) {
+                zone_devices[z]->fan.setSpeed(0);
+            }
+        }
         //also send last wifi credentials if rebooted
         Message wifi_message;
         wifi_message.type = NETWORK_CONFIG;
@@ -60,136 +66,358 @@ void Control::task_impl() {
     xQueueSendToBack(to_UI, &co2_eeprom, portMAX_DELAY);
     xQueueSendToBack(to_Network, &co2_eeprom, portMAX_DELAY);
     printf("EEPROM CO2: %u\n", last_co2_set);
-    uint co2_set = last_co2_set;
 
     Message from_eeprom;
     from_eeprom.type = MONITORED_DATA;
-    // initial data (set co2 and last fan speed) is sent from eeprom as last read values. Other values are displayed
-    //as 0s until measured again after reboot. Was done to be able to retrieve required data after reboot
-    from_eeprom.data.co2_val = 0;
-    from_eeprom.data.humidity = 0;
-    from_eeprom.data.temperature = 0;
-    from_eeprom.data.fan_speed = 0;
+    // initial data is the last snapshot, or 0s until measured again if there was none
+    from_eeprom.data.co2_val = zones[0].co2_val;
+    from_eeprom.data.humidity = zones[0].humidity / 10.0;
+    from_eeprom.data.temperature = zones[0].temperature / 10.0;
+    from_eeprom.data.fan_speed = zones[0].fan_speed;
     xQueueSendToBack(to_UI, &from_eeprom, portMAX_DELAY);
+    storage.flush();
 
 
-    TickType_t last_valve_time = xTaskGetTickCount();
-    bool valve_open = false;
-
     while(true) {
-        //monitored data and message type are saved in structs.h
-        Monitored_data data{};
-        MessageType msg = MONITORED_DATA;
-        Message message{};
         Message received;
 
-        //main CO2 control logic which is triggered by the timer for getting monitored data.
-        if (xSemaphoreTake(timer_semphr, pdMS_TO_TICKS(10)) == pdTRUE) {
-            eeprom->printAllLogs();
-            //getting monitored data from the sensors (GMP252- CO2, HMP60 -RH & TEM) -without Error checking
-            data.co2_val = co2.read_value();
-            printf("co2_val: %u\n", data.co2_val);
-            if(data.co2_val == 0){
-                eeprom->writeLog("co2 measure failed this round");
-            }else{
-                eeprom->writeLog("co2 measured");
-            }
-            //vTaskDelay(pdMS_TO_TICKS(10));
-            data.temperature = tem_hum_sensor.read_tem();
-            printf("temperature: %.1f\n", data.temperature);
-            eeprom->writeLog("temp measured");
-            vTaskDelay(pdMS_TO_TICKS(10));
-            data.humidity = tem_hum_sensor.read_hum();
-            printf("humidity: %.1f\n", data.humidity);
-            if(data.humidity == 0){
-                //humidity and temperature use the same sensor
-                eeprom->writeLog("T&RH measure failed this round");
-            }else{
-                eeprom->writeLog("humidity measured");
+        // sleep until the next cycle is due, messages from UI and network wake the task earlier
+        storage.releaseBus();
+        bool message = xQueueReceive(to_CO2, &received, cycle_timer.time_to_release()) == pdTRUE;
+        storage.holdBus();
+        if (message) {
+            handle_message(received);
+        }
+
+        if (cycle_timer.due()) {
+            cycle_timer.begin();
+            measure_cycle();
+            cycle_timer.end();
+
+            if (cycle_timer.cycles % TIMING_PRINT_CYCLES == 0) {
+                cycle_timer.print();
+                storage.printStats();
             }
+        }
+        // rules uploaded from the console replace the running program, timers start over
+        if (storage.rulesChanged()) {
+            load_rules();
+            for (auto &timers: rule_timers) timers = RuleTimers{};
+        }
+        // records of this round that share a page go out in one page write
+        storage.flush();
+    }
+}
+
+//main CO2 control logic, run once per measurement period
+void Control::measure_cycle() {
+    Message message{};
+
+    // poll as many zones as fit in the bus budget, continuing from where the last cycle stopped
+    uint count = zones_this_cycle();
+    bool dose[MAX_ZONES] = {};
+    rule_eval_us = 0;
+    uint64_t cycle_start = time_us_64();
+    for (uint i = 0; i < count; i++) {
+        uint z = (next_zone + i) % zone_count;
+        poll_zone(z);
+        //main co2 level control logic
+        dose[z] = control_zone(z);
+    }
+    auto elapsed = static_cast<uint32_t>(time_us_64() - cycle_start);
+    for (uint i = count; i < zone_count; i++) {
+        ZoneState &skipped = zones[(next_zone + i) % zone_count];
+        if (skipped.stale_cycles < UINT8_MAX) skipped.stale_cycles++;
+    }
+    next_zone = (next_zone + count) % zone_count;
+    zone_poll_us = zone_poll_average(zone_poll_us, elapsed, count);
+    printf("cycle: %u/%u zones in %lu us, rules %lu us\n", count, zone_count, elapsed, rule_eval_us);
+
+    // UI and cloud follow zone 0
+    const ZoneState &primary = zones[0];
+    message.type = MONITORED_DATA;
+    message.data.co2_val = primary.co2_val;
+    message.data.temperature = primary.temperature / 10.0;
+    message.data.humidity = primary.humidity / 10.0;
+    message.data.fan_speed = primary.fan_speed;
+
+    storage.writeSetting(SETTING_FAN_SPEED, primary.fan_speed);
+
+    // every round is kept for the uplink whether the cloud is reachable or not, it sends them in order
+    SampleRecord sample;
+    sample.time = DeviceTime::now();
+    sample.co2_val = primary.co2_val;
+    sample.temperature = primary.temperature;
+    sample.humidity = primary.humidity;
+    sample.co2_set = primary.co2_set;
+    sample.fan_speed = primary.fan_speed;
+    sample.zone = 0;
+    storage.logSample(sample);
+
+    // send data to queues from co2 control task, the uplink reads the sample buffer instead
+    xQueueSendToBack(to_UI, &message, portMAX_DELAY);
+
+    dose_co2(dose);
+
+    if (++cycles_since_snapshot >= SNAPSHOT_INTERVAL) {
+        save_snapshot();
+        cycles_since_snapshot = 0;
+    }
+}
 
-            data.fan_speed = fan.getSpeed();
-            printf("fan_speed: %u\n", data.fan_speed);
+//get data from UI and network
+void Control::handle_message(const Message &received) {
+    if (received.type == CO2_SET_DATA) {
+        if(received.co2_set < max_co2){
+            zones[0].co2_set = received.co2_set;
+            // the set level changes often, it goes to its wear ring instead of the config block
+            storage.writeSetting(SETTING_CO2_SET, zones[0].co2_set);
+            storage.logEvent(EV_CO2_SET_CHANGED, 0, zones[0].co2_set);
+            printf("CONTROL co2: %u\n", received.co2_set);
+        }
+    } else if (received.type == NETWORK_CONFIG) {
+        strcpy(wifi_ssid, received.network_config.ssid);
+        storage.setConfig(CFG_WIFI_SSID, wifi_ssid);
 
-            eeprom->writeLog("pressure measured");
-            message.type = msg;
-            message.data = data;
+        strcpy(wifi_pass,received.network_config.password);
+        storage.setConfig(CFG_WIFI_PASS, wifi_pass);
+    }
+}
 
+void Control::init_zones(const std::shared_ptr<ModbusClient> &rtu_client, uint16_t co2_set_zone0) {
+    zone_count = zone_config_count;
+    for (uint z = 0; z < zone_count; z++) {
+        zone_devices[z].emplace(rtu_client, zone_config[z]);
+        zones[z] = ZoneState{};
+        zones[z].co2_set = zone_config[z].co2_set;
+        zones[z].last_valve_time = xTaskGetTickCount();
+    }
+    // zone 0 set level is the one saved in eeprom
+    zones[0].co2_set = co2_set_zone0;
+}
 
-            //main co2 level control logic
-            handle_fan_control(fan, data.co2_val, max_co2, co2_set);
+// number of zones that fit in the bus budget with the measured poll time
+uint Control::zones_this_cycle() const {
+    return zones_per_cycle(zone_poll_us, zone_count);
+}
 
-            snprintf(status_buffer, sizeof(status_buffer), "%u", fan.getSpeed());
-            eeprom->writeStatus(FAN_SPEED_ADDR, status_buffer);
+//getting monitored data from the sensors of one zone (GMP252- CO2, HMP60 -RH & TEM) -without Error checking
+void Control::poll_zone(uint zone) {
+    ZoneState &state = zones[zone];
+    ZoneDevices &dev = *zone_devices[zone];
+
+    state.co2_val = dev.co2.read_value();
+    printf("zone %u co2_val: %u\n", zone, state.co2_val);
+    if(state.co2_val == 0){
+        storage.logEvent(EV_CO2_FAILED, zone);
+    }else{
+        storage.logEvent(EV_CO2_MEASURED, zone, state.co2_val);
+    }
 
-            message.data.fan_speed = fan.getSpeed();
-            // send data to queues from co2 control task
-            xQueueSendToBack(to_UI, &message, portMAX_DELAY);
+    //humidity and temperature use the same sensor, both are read in one transaction
+    dev.tem_hum.read_all();
+    state.temperature = static_cast<int16_t>(lround(dev.tem_hum.tem() * 10));
+    state.humidity = static_cast<uint16_t>(lround(dev.tem_hum.hum() * 10));
+    printf("zone %u temperature: %.1f humidity: %.1f\n", zone, dev.tem_hum.tem(), dev.tem_hum.hum());
+    if(state.humidity == 0){
+        storage.logEvent(EV_TRH_FAILED, zone);
+    }else{
+        storage.logEvent(EV_TRH_MEASURED, zone, state.humidity);
+    }
 
-            EventBits_t bits = xEventGroupGetBits(network_event_group);
+    state.stale_cycles = 0;
+}
 
-            //only send information to network once it is connected to the cloud
-            if (bits & CLOUD_CONNECTED_BIT){
-                xQueueSendToBack(to_Network, &message, portMAX_DELAY);
-            }
+// fan control of one zone, returns true if the zone's valve should be opened
+bool Control::control_zone(uint zone) {
+    ZoneState &state = zones[zone];
+    ZoneDevices &dev = *zone_devices[zone];
+
+    int32_t inputs[CH_COUNT];
+    zone_rule_inputs(state, max_co2, inputs);
+    RuleActions actions;
+    uint32_t rule_start = time_us_32();
+    rules.evaluate(inputs, rule_timers[zone], xTaskGetTickCount() * portTICK_PERIOD_MS, actions);
+    rule_eval_us += time_us_32() - rule_start;
+
+    handle_fan_control(zone, dev.fan, state, actions.fan);
+    if (!dev.fan.sync()) {
+        storage.logEvent(EV_FAN_DIVERGED, zone, dev.fan.getSpeed());
+    }
+    state.fan_speed = dev.fan.getSpeed();
+    const ShadowRegister &speed_reg = dev.fan.speedRegister();
+    printf("zone %u fan_speed: %u (writes %lu, skipped %lu, diverged %lu)\n", zone, state.fan_speed,
+           speed_reg.writes, speed_reg.skipped, speed_reg.divergences);
 
-            // a minute at least between openings
-            if(data.co2_val <= co2_set) {
-                if (!valve_open) {
-                    valve.open();
-                    printf("valve open\n");
-                    eeprom->writeLog("valve open");
-
-                    //following is for real system,open the valve only for 0.5s!
-                    vTaskDelay(pdMS_TO_TICKS(500));
-
-                    valve.close();
-                    eeprom->writeLog("valve closed");
-                    valve_open = true;
-                    last_valve_time = xTaskGetTickCount();
-                } else {
-                    TickType_t current_time = xTaskGetTickCount();
-                    // at least a minute interval between valve opening again to let co2 spread
-                    if (current_time - last_valve_time > pdMS_TO_TICKS(30000)) {
-                        valve_open = false;
-                    }
-                }
-            }
+    return zone_wants_dose(state, actions.block_dose, xTaskGetTickCount(), pdMS_TO_TICKS(VALVE_LOCKOUT_MS));
+}
+
+// all valves that need co2 are opened together so that the dosing time doesn't grow with zone count
+void Control::dose_co2(const bool *dose) {
+    uint16_t opened = 0;
+    for (uint z = 0; z < zone_count; z++) {
+        if (dose[z]) {
+            zone_devices[z]->valve.open();
+            printf("zone %u valve open\n", z);
+            opened++;
+        }
+    }
+    if (opened == 0) return;
+    storage.logEvent(EV_VALVE_OPEN, 0, opened);
+
+    //following is for real system,open the valve only for 0.5s!
+    vTaskDelay(pdMS_TO_TICKS(500));
+
+    TickType_t now = xTaskGetTickCount();
+    for (uint z = 0; z < zone_count; z++) {
+        if (dose[z]) {
+            zone_devices[z]->valve.close();
+            zones[z].valve_open = true;
+            zones[z].last_valve_time = now;
+        }
+    }
+    storage.logEvent(EV_VALVE_CLOSED, 0, opened);
+}
+
+// rule program is kept in eeprom, default rules are compiled and stored if there is no valid program
+void Control::load_rules() {
+    static uint8_t program[RULE_PROGRAM_MAX];
+    uint8_t header[4];
+
+    if (storage.read(RULES_ADDR, header, sizeof(header))) {
+        uint16_t len = header[0] | (header[1] << 8);
+        uint16_t crc = header[2] | (header[3] << 8);
+        if (len <= RULE_PROGRAM_MAX && storage.read(RULES_ADDR + sizeof(header), program, len) &&
+            EEPROM::crc16(program, len) == crc && rules.load(program, len)) {
+            printf("%u rules loaded from EEPROM (%u bytes)\n", rules.rule_count(), len);
+            return;
         }
+    }
 
-        //get data from UI and network
-        if(xQueueReceive(to_CO2, &received, 0) == pdTRUE){
-            if (received.type == CO2_SET_DATA) {
-                if(received.co2_set < max_co2){
-                    co2_set = received.co2_set;
-                    snprintf(status_buffer, sizeof(status_buffer), "%u", co2_set);
-                    if (eeprom->writeStatus(CO2_SET_ADDR, status_buffer)) {
-                        printf("co2 set val written to EEPROM\n");
-                        eeprom->writeLog("co2 val changed");
-                    }
-                    printf("CONTROL co2: %u\n", received.co2_set);
-                }
-            } else if (received.type == NETWORK_CONFIG) {
-                strcpy(wifi_ssid, received.network_config.ssid);
-                eeprom->writeStatus(WIFI_SSID_ADDR, wifi_ssid, STR_BUFFER_SIZE);
-
-                strcpy(wifi_pass,received.network_config.password);
-                eeprom->writeStatus(WIFI_PASS_ADDR, wifi_pass, STR_BUFFER_SIZE);
-            }
+    RuleCompiler compiler;
+    size_t len = compiler.compile(default_rules, program, sizeof(program));
+    if (len == 0) {
+        printf("default rules line %d: %s\n", compiler.error_line(), compiler.error());
+        return;
+    }
+    if (rules.load(program, len) && store_rules(program, len)) {
+        printf("%u default rules stored to EEPROM\n", rules.rule_count());
+        storage.logEvent(EV_RULES_STORED, 0, rules.rule_count());
+    }
+}
+
+bool Control::store_rules(const uint8_t *program, size_t len) {
+    static uint8_t image[RULES_SIZE];
+    if (len + RULES_HEADER_SIZE > sizeof(image)) {
+        return false;
+    }
+    std::memcpy(image + RULES_HEADER_SIZE, program, len);
+    EEPROM::rulesHeader(image, len);
+
+    storage.write(RULES_ADDR, image, len + RULES_HEADER_SIZE);
+    return storage.fence();
+}
+
+void Control::save_snapshot() {
+    static Snapshot snap;
+    TickType_t now = xTaskGetTickCount();
+
+    snap.header.magic = SNAPSHOT_MAGIC;
+    snap.header.version = SNAPSHOT_VERSION;
+    snap.header.zone_count = zone_count;
+    snap.header.seq = ++snapshot_seq;
+    snap.header.zone_poll_us = zone_poll_us;
+    for (uint z = 0; z < zone_count; z++) {
+        const ZoneState &state = zones[z];
+        ZoneSnapshot &entry = snap.zones[z];
+        entry.co2_val = state.co2_val;
+        entry.co2_set = state.co2_set;
+        entry.temperature = state.temperature;
+        entry.humidity = state.humidity;
+        entry.fan_speed = state.fan_speed;
+        entry.valve_lockout_ms = 0;
+        TickType_t locked = now - state.last_valve_time;
+        if (state.valve_open && locked < pdMS_TO_TICKS(VALVE_LOCKOUT_MS)) {
+            entry.valve_lockout_ms = (pdMS_TO_TICKS(VALVE_LOCKOUT_MS) - locked) * portTICK_PERIOD_MS;
+        }
+        entry.flags = (state.valve_open ? ZONE_SNAP_VALVE_OPEN : 0) | (state.rule_fan ? ZONE_SNAP_RULE_FAN : 0);
+        entry.stale_cycles = state.stale_cycles;
+    }
+
+    size_t len = snapshot_len(zone_count);
+    auto *bytes = reinterpret_cast<uint8_t *>(&snap);
+    snap.header.len = len;
+    snap.header.crc = EEPROM::crc16(bytes + sizeof(snap.header.crc), len - sizeof(snap.header.crc));
+
+    // slots are written in turn so that the previous snapshot survives a power cut during the write
+    uint16_t slot_addr = SNAPSHOT_ADDR + (snapshot_seq & 1) * SNAPSHOT_SLOT_SIZE;
+    storage.write(slot_addr, bytes, len);
+}
+
+// restores the newer valid snapshot slot, both slots are read in one transaction
+bool Control::restore_snapshot() {
+    static_assert(sizeof(Snapshot) <= SNAPSHOT_SLOT_SIZE, "snapshot doesn't fit in its slot");
+    static uint8_t slots[2 * SNAPSHOT_SLOT_SIZE];
+    if (!storage.read(SNAPSHOT_ADDR, slots, sizeof(slots))) {
+        return false;
+    }
+
+    const Snapshot *newest = nullptr;
+    for (int i = 0; i < 2; i++) {
+        auto *snap = reinterpret_cast<const Snapshot *>(slots + i * SNAPSHOT_SLOT_SIZE);
+        const SnapshotHeader &h = snap->header;
+        if (h.magic != SNAPSHOT_MAGIC || h.version != SNAPSHOT_VERSION || h.zone_count != zone_count ||
+            h.len != snapshot_len(h.zone_count)) {
+            continue;
+        }
+        auto *bytes = reinterpret_cast<const uint8_t *>(snap);
+        if (EEPROM::crc16(bytes + sizeof(h.crc), h.len - sizeof(h.crc)) != h.crc) {
+            continue;
         }
+        if (!newest || static_cast<int32_t>(h.seq - newest->header.seq) > 0) {
+            newest = snap;
+        }
+    }
+    if (!newest) {
+        printf("No valid snapshot, cold start\n");
+        return false;
     }
+
+    TickType_t now = xTaskGetTickCount();
+    for (uint z = 0; z < zone_count; z++) {
+        const ZoneSnapshot &entry = newest->zones[z];
+        ZoneState &state = zones[z];
+        state.co2_val = entry.co2_val;
+        // zone 0 set level comes from its own eeprom status
+        if (z != 0) state.co2_set = entry.co2_set;
+        state.temperature = entry.temperature;
+        state.humidity = entry.humidity;
+        state.fan_speed = entry.fan_speed;
+        state.valve_open = entry.flags & ZONE_SNAP_VALVE_OPEN;
+        state.rule_fan = entry.flags & ZONE_SNAP_RULE_FAN;
+        state.stale_cycles = entry.stale_cycles;
+        // lockout continues where it was left
+        state.last_valve_time = now - (pdMS_TO_TICKS(VALVE_LOCKOUT_MS) - pdMS_TO_TICKS(entry.valve_lockout_ms));
+        zone_devices[z]->fan.setSpeed(entry.fan_speed);
+    }
+    zone_poll_us = newest->header.zone_poll_us;
+    snapshot_seq = newest->header.seq;
+    printf("Warm restart from snapshot %lu\n", snapshot_seq);
+    storage.logEvent(EV_WARM_RESTART, 0, snapshot_seq & 0xFFFF);
+    return true;
 }
 
-void Control::handle_fan_control(Produal &fan, uint16_t co2_level, uint16_t max_co2, uint16_t set_co2) {
-    if (co2_level >= max_co2) {
-        fan.setSpeed(max_fan_speed);
+// the speed is worked out first so the fan gets one command per cycle
+void Control::handle_fan_control(uint zone, Produal &fan, ZoneState &state, int16_t rule_min) {
+    uint16_t speed = zone_fan_speed(state, fan.getSpeed(), max_co2, max_fan_speed, rule_min);
+    fan.setSpeed(speed);
+
+    if (state.co2_val >= max_co2) {
         vTaskDelay(pdMS_TO_TICKS(10));
 
         if(!check_fan(fan)) {
-            eeprom->writeLog("Fan failed");
+            storage.logEvent(EV_FAN_FAILED, zone, speed);
         }
-    } else if (co2_level <= set_co2) {
-        fan.setSpeed(0);
     }
 }
 
@@ -209,52 +437,37 @@ bool Control::check_fan(Produal &fan){
 
 void Control::check_last_eeprom_data(uint16_t *last_co2_set, uint16_t *last_fan_speed, bool *rebooted,
     char *wifi_ssid, char *wifi_pass) {
-    // eeprom checking last saved data
-    eeprom->readStatus(REBOOT_ADDR, status_buffer, STATUS_BUFF_SIZE);
+    // settings come from the config mirror of the storage task, loaded with one read at its start
+    storage.waitReady();
     //check if the system turned of while running
-    if (strcmp(status_buffer, RUN_FLAG) == 0) {
+    uint32_t run_state = storage.getConfig(CFG_RUN_STATE);
+    if (run_state == RUN_STATE_RUNNING) {
         *rebooted = true;
-        eeprom->writeLog("Unexpected system shutdown");
-    } else if (strcmp(status_buffer, REBOOT_FLAG) == 0) {
+        storage.logEvent(EV_UNEXPECTED_START);
+    } else if (run_state == RUN_STATE_STOPPED) {
         *rebooted = false;
-        eeprom->writeLog("Normal system start");
+        storage.logEvent(EV_NORMAL_START);
     } else {
         //if first time or data corrupted
         *rebooted = false;
-        eeprom->writeLog("First system start");
+        storage.logEvent(EV_FIRST_START);
     }
     // mark system as running
-    eeprom->writeStatus(REBOOT_ADDR, RUN_FLAG);
+    storage.setConfig(CFG_RUN_STATE, RUN_STATE_RUNNING);
 
-    eeprom->readStatus(CO2_SET_ADDR, status_buffer, STATUS_BUFF_SIZE);
-    *last_co2_set = atoi(status_buffer);
-    if (*last_co2_set < 500 || *last_co2_set > 1500) {
-        clearEEPROM();// shouldn't be anything outside these values cause they are restricted in UI and Netw
+    // the config holds the level of a device whose ring is still empty
+    if (!storage.readSetting(SETTING_CO2_SET, last_co2_set)) {
+        *last_co2_set = storage.getConfig(CFG_CO2_SET);
+    }
+    if (*last_co2_set < MIN_CO2_SET || *last_co2_set > MAX_CO2_SET) {
+        // shouldn't be anything outside these values cause they are restricted in UI and Netw
         *last_co2_set = 700;
     }
-
-    // read last saved wifi and pass
-    eeprom->readStatus(WIFI_SSID_ADDR, string_buffer, STR_BUFFER_SIZE, STR_BUFFER_SIZE);
-    strcpy(wifi_ssid, string_buffer);
-
-    eeprom->readStatus(WIFI_PASS_ADDR, string_buffer, STR_BUFFER_SIZE, STR_BUFFER_SIZE);
-    strcpy(wifi_pass, string_buffer);
-}
-
-void Control::clearEEPROM() {
-    printf("Clearing entire EEPROM...\n");
-
-    const size_t CHUNK_SIZE = 32;
-    uint8_t zero_buffer[CHUNK_SIZE] = {};
-
-    // Adjust max address based on your EEPROM size (e.g., 0x7FFF for 32KB)
-    for (uint16_t addr = 0; addr <= 0x7FFF; addr += CHUNK_SIZE) {
-        eeprom->eepromWrite(addr, zero_buffer, CHUNK_SIZE);
-
-        if (addr % 256 == 0) {
-            printf("Cleared: 0x%04X\n", addr);
-        }
+    if (!storage.readSetting(SETTING_FAN_SPEED, last_fan_speed)) {
+        *last_fan_speed = 0;
     }
-    printf("EEPROM cleared!\n");
-}
 
+    // last saved wifi and pass
+    storage.getConfig(CFG_WIFI_SSID, wifi_ssid, STR_BUFFER_SIZE);
+    storage.getConfig(CFG_WIFI_PASS, wifi_pass, STR_BUFFER_SIZE);
+}
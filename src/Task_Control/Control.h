@@ -7,6 +7,11 @@
 #define BAUD_RATE 9600
 #define STOP_BITS 2
 
+// measurement and control period
+#define MEASURE_PERIOD_MS 20000
+// cycles between full timing histogram printouts
+#define TIMING_PRINT_CYCLES 15
+
 #include "FreeRTOS.h"
 #include "semphr.h"
 #include "task.h"
@@ -17,26 +22,43 @@
 #include "Valve/Valve.h"
 #include "Structs.h"
 #include "EEPROM/EEPROM.h"
+#include "Task_Storage/Storage.h"
+#include "Zone.h"
+#include "Snapshot.h"
+#include "CycleTimer.h"
+#include "Rules/RuleEngine.h"
 #include <event_groups.h>
+#include <optional>
 
 
 
 class Control {
 public:
-    Control(SemaphoreHandle_t timer, QueueHandle_t to_UI, QueueHandle_t to_Network, QueueHandle_t to_CO2,EventGroupHandle_t network_event_group,uint32_t stack_size = 1024, UBaseType_t priority = tskIDLE_PRIORITY + 2);
+    Control(QueueHandle_t to_UI, QueueHandle_t to_Network, QueueHandle_t to_CO2,EventGroupHandle_t network_event_group,
+        Storage &storage, uint32_t stack_size = 1024, UBaseType_t priority = tskIDLE_PRIORITY + 2);
     static void task_wrap(void *pvParameters);
 
 
 private:
     // Private functions
     void task_impl();
+    void measure_cycle();
+    void handle_message(const Message &received);
+    void init_zones(const std::shared_ptr<ModbusClient> &rtu_client, uint16_t co2_set_zone0);
+    uint zones_this_cycle() const;
+    void poll_zone(uint zone);
+    bool control_zone(uint zone);
+    void dose_co2(const bool *dose);
+    void load_rules();
+    bool store_rules(const uint8_t *program, size_t len);
+    void save_snapshot();
+    bool restore_snapshot();
     bool check_fan(Produal &fan);
-    void handle_fan_control(Produal &fan, uint16_t co2_level, uint16_t max_co2, uint16_t set_co2);
+    void handle_fan_control(uint zone, Produal &fan, ZoneState &state, int16_t rule_min);
     void check_last_eeprom_data(uint16_t *last_co2_set, uint16_t *last_fan_speed, bool *rebooted,
         char *wifi_ssid, char *wifi_pass);
-    void clearEEPROM();
 
-    SemaphoreHandle_t timer_semphr;
+    CycleTimer cycle_timer;
     TaskHandle_t control_task;
     const char *name = "CONTROL";
     uint16_t max_co2 = 2000;
@@ -47,10 +69,24 @@ private:
     QueueHandle_t to_CO2;
     EventGroupHandle_t network_event_group;
 
+    // zones: hot control state in one array, devices kept apart
+    ZoneState zones[MAX_ZONES];
+    std::optional<ZoneDevices> zone_devices[MAX_ZONES];
+    uint zone_count = 0;
+    uint next_zone = 0; // round-robin start for the next cycle
+    uint32_t zone_poll_us = ZONE_POLL_ESTIMATE_US;
+
+    // user rules evaluated for every polled zone
+    RuleEngine rules;
+    RuleTimers rule_timers[MAX_ZONES] = {};
+    uint32_t rule_eval_us = 0; // rule evaluation time during the current cycle
+
+    // warm restart snapshot
+    uint32_t snapshot_seq = 0;
+    uint cycles_since_snapshot = 0;
+
     // VALUES FROM EEPROM
-    std::shared_ptr<EEPROM> eeprom;
-    char status_buffer[STATUS_BUFF_SIZE];
-    char string_buffer[STR_BUFFER_SIZE];
+    Storage &storage;
     uint16_t last_co2_set;
     uint16_t last_fan_speed;
     bool rebooted;
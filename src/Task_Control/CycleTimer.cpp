@@ -0,0 +1,66 @@
+#include "CycleTimer.h"
+
+#include <cstdio>
+#include "pico/stdlib.h"
+
+void CycleHistogram::add(uint32_t us) {
+    uint bucket = us ? 32 - __builtin_clz(us) : 0;
+    if (bucket >= CYCLE_HIST_BUCKETS) bucket = CYCLE_HIST_BUCKETS - 1;
+    buckets[bucket]++;
+    count++;
+    sum += us;
+    if (us < min) min = us;
+    if (us > max) max = us;
+}
+
+void CycleHistogram::print(const char *title) const {
+    if (!count) return;
+    printf("%s: n=%lu min=%lu avg=%lu max=%lu us\n", title, count, min, static_cast<uint32_t>(sum / count), max);
+    for (uint i = 0; i < CYCLE_HIST_BUCKETS; i++) {
+        if (buckets[i]) {
+            printf("  <%8lu us: %lu\n", 1UL << i, buckets[i]);
+        }
+    }
+}
+
+CycleTimer::CycleTimer(uint32_t period_ms) :
+        period_us(period_ms * 1000ULL), release_us(time_us_64() + period_ms * 1000ULL) {
+}
+
+TickType_t CycleTimer::time_to_release() const {
+    uint64_t now = time_us_64();
+    if (now >= release_us) return 0;
+    // round up so that the task doesn't wake just before the release
+    return pdMS_TO_TICKS((release_us - now + 999) / 1000);
+}
+
+bool CycleTimer::due() const {
+    return time_us_64() >= release_us;
+}
+
+void CycleTimer::begin() {
+    start_us = time_us_64();
+    jitter.add(static_cast<uint32_t>(start_us - release_us));
+}
+
+void CycleTimer::end() {
+    uint64_t end_us = time_us_64();
+    execution.add(static_cast<uint32_t>(end_us - start_us));
+    cycles++;
+
+    // releases stay on the fixed grid, a cycle that ran late doesn't shift the following ones
+    release_us += period_us;
+    if (end_us > release_us) {
+        overruns++;
+        while (release_us + period_us <= end_us) {
+            release_us += period_us;
+            skipped++;
+        }
+    }
+}
+
+void CycleTimer::print() const {
+    printf("--cycle timing-- cycles %lu, overruns %lu, skipped %lu\n", cycles, overruns, skipped);
+    jitter.print("start jitter");
+    execution.print("execution");
+}
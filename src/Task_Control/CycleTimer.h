@@ -0,0 +1,46 @@
+#ifndef CYCLETIMER_H
+#define CYCLETIMER_H
+
+#include <cstdint>
+#include "FreeRTOS.h"
+
+#define CYCLE_HIST_BUCKETS 25 // log2 buckets of microseconds, last one is 2^23 us (8.4 s) and up
+
+// histogram with power of two buckets: bucket 0 is 0 us, bucket n is [2^(n-1), 2^n) us
+struct CycleHistogram {
+    void add(uint32_t us);
+    void print(const char *title) const;
+
+    uint32_t buckets[CYCLE_HIST_BUCKETS] = {};
+    uint32_t count = 0;
+    uint32_t min = UINT32_MAX;
+    uint32_t max = 0;
+    uint64_t sum = 0;
+};
+
+// Release times for a periodic loop. The task sleeps until the next release (or until
+// something else wakes it), then begin() and end() bracket the work of the cycle.
+// Start jitter, execution time and deadline overruns are recorded for diagnostics.
+class CycleTimer {
+public:
+    explicit CycleTimer(uint32_t period_ms);
+    // ticks until the next release, 0 when the cycle is due
+    TickType_t time_to_release() const;
+    bool due() const;
+    void begin();
+    void end();
+    void print() const;
+
+    CycleHistogram jitter;     // how late the cycle started
+    CycleHistogram execution;  // how long it took
+    uint32_t cycles = 0;
+    uint32_t overruns = 0;     // cycles that ran past the next release
+    uint32_t skipped = 0;      // releases missed because of overruns
+
+private:
+    uint64_t period_us;
+    uint64_t release_us;
+    uint64_t start_us = 0;
+};
+
+#endif //CYCLETIMER_H
@@ -0,0 +1,48 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstdint>
+#include <cstddef>
+#include "Zone.h"
+
+// Warm restart snapshot of the control state. Two slots in EEPROM are written in turn,
+// the valid one with the higher sequence number is restored at boot.
+#define SNAPSHOT_MAGIC 0x534E
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_INTERVAL 3 // measurement cycles between snapshots (one minute)
+
+struct ZoneSnapshot {
+    uint16_t co2_val;
+    uint16_t co2_set;
+    int16_t temperature;
+    uint16_t humidity;
+    uint16_t fan_speed;
+    uint16_t valve_lockout_ms; // lockout time left when the snapshot was taken
+    uint8_t flags;
+    uint8_t stale_cycles;
+};
+
+#define ZONE_SNAP_VALVE_OPEN (1 << 0)
+#define ZONE_SNAP_RULE_FAN (1 << 1)
+
+struct SnapshotHeader {
+    uint16_t crc;         // over everything after this field, len bytes in total
+    uint16_t len;
+    uint16_t magic;
+    uint8_t version;
+    uint8_t zone_count;
+    uint32_t seq;
+    uint32_t zone_poll_us;
+};
+
+// only zone_count entries of zones are stored
+struct Snapshot {
+    SnapshotHeader header;
+    ZoneSnapshot zones[MAX_ZONES];
+};
+
+static constexpr size_t snapshot_len(uint zone_count) {
+    return offsetof(Snapshot, zones) + zone_count * sizeof(ZoneSnapshot);
+}
+
+#endif //SNAPSHOT_H
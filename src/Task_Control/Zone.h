@@ -0,0 +1,44 @@
+#ifndef ZONE_H
+#define ZONE_H
+
+#include <memory>
+#include "FreeRTOS.h"
+#include "Fan/Produal.h"
+#include "CO2_sensor/GMP252.h"
+#include "T_RH_sensor/HMP60.h"
+#include "Valve/Valve.h"
+#include "ZoneSchedule.h"
+#include "ZoneControl.h"
+
+// one greenhouse compartment: modbus addresses of its devices, valve gpio and default co2 set level
+struct ZoneConfig {
+    uint8_t co2_address;
+    uint8_t trh_address;
+    uint8_t fan_address;
+    uint8_t valve_pin;
+    uint16_t co2_set;
+};
+
+// zone table, all zones share the same RTU bus. Zone 0 is the one shown in UI and uploaded to the cloud
+static constexpr ZoneConfig zone_config[] = {
+    // co2, T&RH, fan, valve, co2 set
+    {240, 241, 1, 27, 700},
+};
+static constexpr uint zone_config_count = sizeof(zone_config) / sizeof(zone_config[0]);
+static_assert(zone_config_count <= MAX_ZONES, "too many zones in zone table");
+
+// devices of a zone, only used when the zone is polled
+struct ZoneDevices {
+    ZoneDevices(const std::shared_ptr<ModbusClient> &client, const ZoneConfig &config) :
+        co2(client, config.co2_address),
+        tem_hum(client, config.trh_address),
+        fan(client, config.fan_address),
+        valve(config.valve_pin) {}
+
+    GMP252 co2;
+    HMP60 tem_hum;
+    Produal fan;
+    Valve valve;
+};
+
+#endif //ZONE_H
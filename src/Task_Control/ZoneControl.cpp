@@ -0,0 +1,44 @@
+#include "ZoneControl.h"
+
+void zone_rule_inputs(const ZoneState &state, uint16_t max_co2, int32_t inputs[CH_COUNT]) {
+    inputs[CH_CO2] = state.co2_val * 10;
+    inputs[CH_TEMP] = state.temperature;
+    inputs[CH_RH] = state.humidity;
+    inputs[CH_FAN] = state.fan_speed * 10;
+    inputs[CH_SET] = state.co2_set * 10;
+    inputs[CH_MAX] = max_co2 * 10;
+}
+
+uint16_t zone_fan_speed(ZoneState &state, uint16_t current, uint16_t max_co2, uint16_t max_fan_speed,
+                        int16_t rule_min) {
+    uint16_t speed = current;
+    if (state.co2_val >= max_co2) {
+        speed = max_fan_speed;
+    } else if (state.co2_val <= state.co2_set || (rule_min < 0 && state.rule_fan)) {
+        // also stops a fan that only ran because of a rule that no longer holds
+        speed = 0;
+    }
+    if (rule_min > static_cast<int16_t>(speed)) {
+        speed = rule_min;
+        state.rule_fan = true;
+    } else if (rule_min < 0) {
+        state.rule_fan = false;
+    }
+    return speed;
+}
+
+bool zone_wants_dose(ZoneState &state, bool block_dose, uint32_t now, uint32_t lockout) {
+    if (block_dose) {
+        return false;
+    }
+    if (state.co2_val <= state.co2_set) {
+        if (!state.valve_open) {
+            return true;
+        }
+        // the valve stays shut for the lockout after dosing to let co2 spread
+        if (now - state.last_valve_time > lockout) {
+            state.valve_open = false;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,39 @@
+#ifndef ZONECONTROL_H
+#define ZONECONTROL_H
+
+#include <cstdint>
+#include "Rules/RuleEngine.h"
+
+#define MAX_ZONES 16
+
+// time the valve stays shut after dosing to let co2 spread
+#define VALVE_LOCKOUT_MS 30000
+
+// control state of a zone that is touched every cycle. Kept small (16 bytes) and in one array
+// so that going through all zones reads memory sequentially
+struct ZoneState {
+    uint32_t last_valve_time; // tick count when the valve was last opened
+    uint16_t co2_val;
+    uint16_t co2_set;
+    int16_t temperature;  // 0.1 C
+    uint16_t humidity;    // 0.1 %RH
+    uint16_t fan_speed;
+    uint8_t stale_cycles; // cycles since the zone was last polled
+    bool valve_open : 1;
+    bool rule_fan : 1;    // fan speed is held up by a user rule
+};
+static_assert(sizeof(ZoneState) == 16, "ZoneState should stay compact");
+
+// Decisions of the control pass of one polled zone. Kept apart from the devices and the RTOS
+// so that tools/zonebench runs the same logic on the host.
+
+// inputs of the user rules, which see the values in tenths
+void zone_rule_inputs(const ZoneState &state, uint16_t max_co2, int32_t inputs[CH_COUNT]);
+// fan speed for this cycle from the current one. A rule can keep the fan running faster than
+// the co2 logic wants, rule_min is -1 when no rule asks for it
+uint16_t zone_fan_speed(ZoneState &state, uint16_t current, uint16_t max_co2, uint16_t max_fan_speed,
+                        int16_t rule_min);
+// true if the zone's valve should be opened, now and lockout in ticks
+bool zone_wants_dose(ZoneState &state, bool block_dose, uint32_t now, uint32_t lockout);
+
+#endif //ZONECONTROL_H
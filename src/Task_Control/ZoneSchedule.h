@@ -0,0 +1,27 @@
+#ifndef ZONESCHEDULE_H
+#define ZONESCHEDULE_H
+
+#include <cstdint>
+
+// bus time given to sensor polling out of the 20s measurement period
+#define ZONE_BUS_BUDGET_US 12000000
+// first guess of one zone poll (co2 + T&RH read, fan write, pulse read) at 9600 bps, refined by measurement
+#define ZONE_POLL_ESTIMATE_US 250000
+
+// Zone poll scheduling on the shared RTU bus. Kept apart from the devices so that
+// tools/zonebench runs the same arithmetic on the host.
+
+// number of zones that fit in the bus budget with the measured poll time
+static inline unsigned zones_per_cycle(uint32_t zone_poll_us, unsigned zone_count) {
+    unsigned count = ZONE_BUS_BUDGET_US / (zone_poll_us ? zone_poll_us : 1);
+    if (count < 1) count = 1;
+    if (count > zone_count) count = zone_count;
+    return count;
+}
+
+// running average of the time one zone takes on the bus
+static inline uint32_t zone_poll_average(uint32_t zone_poll_us, uint32_t elapsed_us, unsigned polled) {
+    return (3 * zone_poll_us + elapsed_us / polled) / 4;
+}
+
+#endif //ZONESCHEDULE_H
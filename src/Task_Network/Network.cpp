@@ -2,10 +2,38 @@
 
 #include <cstdio>
 #include <cstring>
-
-
-Network::Network(QueueHandle_t to_CO2,  QueueHandle_t to_UI, QueueHandle_t to_Network,EventGroupHandle_t network_event_group,uint32_t stack_size, UBaseType_t priority):
-    to_CO2(to_CO2),to_UI (to_UI),to_Network(to_Network),network_event_group(network_event_group){
+#include "pico/rand.h"
+#include "DeviceTime.h"
+
+// fields picked out of the thingspeak responses, the bodies themselves aren't kept
+static const char *const update_fields[] = {"entry_id", "command_string"};
+static const char *const command_fields[] = {"command_string"};
+static const char *const bulk_fields[] = {"success"};
+
+// Constant text of the requests. It is sent from flash without copying, only the values that
+// change are formatted
+static const char update_request[] = "GET /update.json?api_key=" THINGSPEAK_WRITE_API "&talkback_key=" TALKBACK_API;
+static const char request_end[] = " HTTP/1.1\r\n"
+                                  "Host: " THINGSPEAK_HOST "\r\n"
+                                  "\r\n";
+static const char bulk_request[] = "POST /channels/" THINGSPEAK_CHANNEL_ID "/bulk_update.json HTTP/1.1\r\n"
+                                   "Host: " THINGSPEAK_HOST "\r\n"
+                                   "Content-Type: application/json\r\n"
+                                   "Content-Length: ";
+static const char header_end[] = "\r\n\r\n";
+static const char execute_request[] = "POST /talkbacks/" TALKBACK_ID "/commands/execute.json HTTP/1.1\r\n"
+                                      "Host: " THINGSPEAK_HOST "\r\n"
+                                      "Content-Length: 24\r\n"
+                                      "Content-Type: application/x-www-form-urlencoded\r\n"
+                                      "\r\n"
+                                      "api_key=" TALKBACK_API;
+static_assert(sizeof("api_key=" TALKBACK_API) - 1 == 24, "Content-Length of the execute request");
+static const char clear_request[] = "DELETE /talkbacks/" TALKBACK_ID "/commands.json?api_key=" TALKBACK_API " HTTP/1.1\r\n"
+                                    "Host: " THINGSPEAK_HOST "\r\n"
+                                    "\r\n";
+
+Network::Network(QueueHandle_t to_CO2,  QueueHandle_t to_UI, QueueHandle_t to_Network,EventGroupHandle_t network_event_group,Storage &storage,uint32_t stack_size, UBaseType_t priority):
+    to_CO2(to_CO2),to_UI (to_UI),to_Network(to_Network),network_event_group(network_event_group),storage(storage){
 
     //load_wifi_cred();
     xTaskCreate(task_wrap, name, stack_size, this, priority, nullptr);
@@ -21,32 +49,18 @@ void Network::task_impl() {
     xEventGroupClearBits(network_event_group, CLOUD_CONNECTED_BIT);
 
     Message received{};
-    Message send{};
 
-    Monitored_data monitored_data{};
     IPStack ip_stack;
-    bool initial_data_ready = false;
+    HttpClient http(ip_stack);
+    TickType_t last_upload = 0;
+    TickType_t upload_wait = 0;
 
     while (true) {
-        //get data from CO2_control and UI. data type received: 1. monitored data. 2. uint CO2 set level. 3. network config
+        //get data from UI and CO2_control: 1. uint CO2 set level. 2. network config.
+        //measurements don't come this way, they are read from the sample buffer in storage
         if (xQueueReceive(to_Network, &received, pdMS_TO_TICKS(10))) {
-            //the received data is from CO2_control_task
-            if(received.type == MONITORED_DATA){
-                printf("QUEUE to Network from CO2_control_task: co2: %d\n", received.data.co2_val);
-                printf("thingspeak: temp: %.1f\n", received.data.temperature);
-                //save the data from sensor readings
-                monitored_data.co2_val = received.data.co2_val;
-                monitored_data.temperature = received.data.temperature;
-                monitored_data.humidity = received.data.humidity;
-                monitored_data.fan_speed = received.data.fan_speed;
-                send.type = MONITORED_DATA;
-                send.data = monitored_data;
-                initial_data_ready = true;
-            }
-
-
             //the received data is from UI task
-            else if(received.type == CO2_SET_DATA){
+            if(received.type == CO2_SET_DATA){
                 //save the co2 set level from the UI task
                 co2_set = received.co2_set;
             }
@@ -74,37 +88,19 @@ void Network::task_impl() {
             if(connect_to_cloud(ip_stack,wifissid,wifipass)){
                 //if cloud is connected, then set the network event group bit as 1
                 xEventGroupSetBits(network_event_group,CLOUD_CONNECTED_BIT);
-                //clear the talkback queue from previously saved data.
-                while(read_co2_set_level(ip_stack)) vTaskDelay(pdMS_TO_TICKS(10));
+                //clear the talkback queue from previously saved data, one request however long it is
+                clear_talkback(http);
             }
 
             xEventGroupClearBits(network_event_group, RECONNECT_WIFI_BIT);
         }
 
         bits = xEventGroupGetBits(network_event_group);
-        if (bits & CLOUD_CONNECTED_BIT && initial_data_ready) {
+        if ((bits & CLOUD_CONNECTED_BIT) && xTaskGetTickCount() - last_upload >= upload_wait) {
             if(ip_stack.WiFi_connected()){
-                //retrieve co2 set level from talkback queue if there is any
-                Message send_msg{};
-                send_msg.type = CO2_SET_DATA;
-                uint tem = read_co2_set_level(ip_stack);
-                if( MIN_CO2_SET < tem && tem <= MAX_CO2_SET){
-                    send_msg.co2_set = tem;
-                    printf("co2_set value from network class: %u",tem);
-                    //sending co2 set level from network to both UI and CO2 queue
-                    xQueueSendToBack(to_UI, &send_msg, pdMS_TO_TICKS(10));
-                    xQueueSendToBack(to_CO2, &send_msg, pdMS_TO_TICKS(10));
-                }
-
-                //upload data to all fields in thingspeak once in 20s
-                bool ok = upload_data_to_cloud(ip_stack,monitored_data,co2_set);
-                if(ok){
-                    printf("Upload success.\n");
-                }else{
-                    printf("Failed to upload.\n");
-                }
-                //delay for 15s as data can be uploaded to thingspeak once in 15s
-                vTaskDelay(pdMS_TO_TICKS(15000));
+                last_upload = xTaskGetTickCount();
+                bool backlog = upload_cycle(ip_stack, http);
+                upload_wait = pdMS_TO_TICKS(next_upload_ms(backlog));
             }else{
                 xEventGroupClearBits(network_event_group, CLOUD_CONNECTED_BIT);
                 printf("Connection lost detected, event bit reset.\n");
@@ -144,96 +140,208 @@ bool Network::connect_to_cloud(IPStack &ip_stack, const char* wifi_ssid, const c
     return (wifi_connected && http_connected);
 }
 
-//upload monitored data & co2_set to the sensor
-bool Network::upload_data_to_cloud(IPStack &ip_stack, Monitored_data &data,uint co2_set){
-    char req[300];
+//one uplink round: the samples waiting go in one bulk request and the talkback command is fetched
+//after it. A single sample goes with an update that executes the command in the same round trip.
+//returns true if samples were left waiting after the round, so the next one should come soon
+bool Network::upload_cycle(IPStack &ip_stack, HttpClient &http){
+    uint tem = 0;
+    bool ok = true;
+    uint16_t count = storage.peekSamples(batch, NETWORK_BATCH_MAX);
+    //a full peek may have more behind it
+    bool more = count == NETWORK_BATCH_MAX;
+    if (count > 1 && channel_id[0] != '\0') {
+        ok = upload_samples(http, batch, count);
+        tem = read_co2_set_level(http);
+    } else if (count > 0) {
+        //without a channel id the backlog goes one sample per round
+        if (count > 1) more = true;
+        count = 1;
+        ok = upload_data_to_cloud(http, batch[0], &tem);
+    } else {
+        //nothing to upload, the talkback command is fetched on its own
+        tem = read_co2_set_level(http);
+    }
+
+    if (count > 0) {
+        if(ok){
+            storage.ackSamples(count);
+            samples_sent += count;
+            failures_in_row = 0;
+            printf("Upload success, %u samples.\n", count);
+        }else{
+            //the samples stay in the buffer and go first, in order, once an upload gets through
+            samples_retried += count;
+            if (failures_in_row < 16) failures_in_row++;
+            printf("Failed to upload, %lu reconnects so far.\n", ip_stack.reconnects());
+            print_uplink_stats(ip_stack);
+        }
+    }
+
+    //co2 set level from talkback queue if there was any
+    if( MIN_CO2_SET < tem && tem <= MAX_CO2_SET){
+        Message send_msg{};
+        send_msg.type = CO2_SET_DATA;
+        send_msg.co2_set = tem;
+        printf("co2_set value from network class: %u",tem);
+        //sending co2 set level from network to both UI and CO2 queue
+        xQueueSendToBack(to_UI, &send_msg, pdMS_TO_TICKS(10));
+        xQueueSendToBack(to_CO2, &send_msg, pdMS_TO_TICKS(10));
+    }
+    return ok && more;
+}
+
+//A backlog is sent as fast as thingspeak allows, otherwise samples gather for an interval.
+//After failures the wait doubles each time, jittered so that devices that lost the uplink
+//together don't all retry at the same moment
+uint32_t Network::next_upload_ms(bool backlog){
+    if (failures_in_row == 0) {
+        if (backlog) printf("Upload backlog, next batch in %d s\n", NETWORK_RATE_LIMIT_MS / 1000);
+        return backlog ? NETWORK_RATE_LIMIT_MS : NETWORK_UPLOAD_INTERVAL_MS;
+    }
+    uint32_t backoff = NETWORK_BACKOFF_MAX_MS;
+    if (failures_in_row < 16 && (NETWORK_RATE_LIMIT_MS << (failures_in_row - 1)) < NETWORK_BACKOFF_MAX_MS) {
+        backoff = NETWORK_RATE_LIMIT_MS << (failures_in_row - 1);
+    }
+    backoff = backoff * 3 / 4 + get_rand_32() % (backoff / 2);
+    printf("Retrying upload in %lu s\n", backoff / 1000);
+    return backoff;
+}
+
+void Network::print_uplink_stats(IPStack &ip_stack){
+    SampleStats stats;
+    storage.sampleStats(&stats);
+    printf("Uplink: %u queued (high water %u), %lu sent, %lu retried, %lu dropped\n",
+           stats.waiting, stats.high_water, samples_sent, samples_retried, stats.dropped);
+    uint32_t avg_us, max_us;
+    ip_stack.wake_latency(&avg_us, &max_us);
+    printf("TCP wake latency: avg %lu us, max %lu us\n", avg_us, max_us);
+}
+
+//bulk_update.json with the samples in order. The body is encoded twice with the same calls:
+//first only counted for Content-Length, then written straight to the connection
+bool Network::upload_samples(HttpClient &http, const SampleRecord *samples, uint16_t count){
+    //both passes use the same post time so the counted length matches the body
+    uint32_t now = DeviceTime::now();
+    JsonStream counter;
+    write_samples(counter, samples, count, now);
+
+    char length[12];
+    int len = snprintf(length, sizeof(length), "%u", counter.length());
+    const TxPart header[] = {
+        {bulk_request, sizeof(bulk_request) - 1, true},
+        {length, static_cast<size_t>(len), false},
+        {header_end, sizeof(header_end) - 1, true},
+    };
+    JsonFields fields;
+    fields.begin(bulk_fields, 1);
+    http.open(&fields);
+    http.send(header, 3);
+    JsonStream body(&http);
+    write_samples(body, samples, count, now);
+    if (!body.finish()) {
+        printf("Bulk upload not sent\n");
+        return false;
+    }
+
+    HttpResult rv = http.wait();
+    if(rv != HTTP_DONE){
+        printf("No response from server %d\n", rv);
+        return false;
+    }
+    printf("%d success: %s\n", http.response().status, fields.value(0));
+    //an accepted batch is answered with {"success":true}
+    int status = http.response().status;
+    return (status == 200 || status == 202) && strcmp(fields.value(0), "true") == 0;
+}
+
+//{"write_api_key":"...","updates":[{"delta_t":120,"field1":...},...]}, delta_t is how many
+//seconds before the post the sample was taken, DeviceTime has no wall clock to give created_at
+void Network::write_samples(JsonStream &json, const SampleRecord *samples, uint16_t count, uint32_t now){
+    json.begin_object();
+    json.value("write_api_key", write_api);
+    json.begin_array("updates");
+    for (uint16_t i = 0; i < count; i++) {
+        json.begin_object();
+        json.value("delta_t", static_cast<int32_t>(samples[i].time < now ? now - samples[i].time : 0));
+        json.value("field1", samples[i].co2_val);
+        json.tenths("field2", samples[i].temperature);
+        json.tenths("field3", samples[i].humidity);
+        json.value("field4", samples[i].fan_speed);
+        json.value("field5", samples[i].co2_set);
+        json.end_object();
+    }
+    json.end_array();
+    json.end_object();
+}
+
+//upload one sample to the channel. command gets the co2 set level of the talkback
+//command executed with the update, 0 if none was queued
+bool Network::upload_data_to_cloud(HttpClient &http, const SampleRecord &sample, uint *command){
+    char values[100];
 
     // Update fields using a minimal GET request - tested to work
-    //uploading monitored data to the cloud
-    snprintf(req,sizeof(req),
-            "GET /update?api_key=%s&field1=%u&field2=%.2f&field3=%.2f&field4=%u&field5=%u HTTP/1.1\r\n"
-            "Host: %s\r\n"
-            "\r\n",
-            write_api,
-            data.co2_val,
-            data.temperature,
-            data.humidity,
-            data.fan_speed,
-            co2_set,
-            host);
-
-    ip_stack.write((unsigned char *)(req),strlen(req));
-    vTaskDelay(pdMS_TO_TICKS(2000));
-    auto rv = ip_stack.read((unsigned char*)buffer, BUFSIZE, 100);
-    if(rv <= 0){
-        printf("No response from server\n");
+    //uploading monitored data to the cloud, only the field values are formatted
+    int len = snprintf(values,sizeof(values),
+            "&field1=%u&field2=%.2f&field3=%.2f&field4=%u&field5=%u",
+            sample.co2_val,
+            sample.temperature / 10.0,
+            sample.humidity / 10.0,
+            sample.fan_speed,
+            sample.co2_set);
+    const TxPart req[] = {
+        {update_request, sizeof(update_request) - 1, true},
+        {values, static_cast<size_t>(len), false},
+        {request_end, sizeof(request_end) - 1, true},
+    };
+
+    //the response is complete as soon as its last byte is in, no fixed wait
+    JsonFields fields;
+    fields.begin(update_fields, 2);
+    HttpResult rv = http.exchange(req, 3, &fields);
+    if(rv != HTTP_DONE){
+        printf("No response from server %d\n", rv);
         return false;
     }
-    buffer[rv] = 0;
-    char* body = extract_thingspeak_http_body();
-    printf("%s\n",body);
-    if(body){
-        int id = atoi(body);
-        if(id > 0){
-            printf("upload monitored data to network. \n");
-            return true;
-        }
+    printf("%d entry_id: %s, command: %s\n", http.response().status, fields.value(0), fields.value(1));
+    //thingspeak answers with the new entry and the executed command, 0 or -1 if the update was refused
+    *command = (uint)atoi(fields.value(1));
+    if(http.response().status == 200 && atoi(fields.value(0)) > 0){
+        printf("upload monitored data to network. \n");
+        return true;
     }
     printf("upload monitored data to network failed. \n");
     return false;
 }
 
 //getting co2 set level from talkback queue in cloud. field6 = co2 level set
-uint Network::read_co2_set_level(IPStack &ip_stack){
-    //ask for command from talkback
-    const char *talkback_api = "api_key=WYYFXF0NGSZCUMW6";
-    char req[256];
-    snprintf(req,sizeof(req), "POST /talkbacks/55392/commands/execute.json HTTP/1.1\r\n"
-                      "Host: api.thingspeak.com\r\n"
-                      "Content-Length: %d\r\n"
-                      "Content-Type: application/x-www-form-urlencoded\r\n"
-                      "\r\n"
-                      "%s",strlen(talkback_api),talkback_api);
-
-    ip_stack.write((unsigned char *)(req),strlen(req));
-    vTaskDelay(pdMS_TO_TICKS(2000));
-
-    auto rv = ip_stack.read((unsigned char*)buffer, BUFSIZE, 100);
-    if(rv <= 0){
-        printf("No response from server\n");
+uint Network::read_co2_set_level(HttpClient &http){
+    //ask for command from talkback, the request doesn't change
+    const TxPart req{execute_request, sizeof(execute_request) - 1, true};
+
+    JsonFields fields;
+    fields.begin(command_fields, 1);
+    HttpResult rv = http.exchange(&req, 1, &fields);
+    if(rv != HTTP_DONE || http.response().status != 200){
+        printf("No response from server %d\n", rv);
         //0 for failed readings.
         return 0;
     }
-    buffer[rv] = 0;
-
-    //full http response in json format
-    printf("HTTP Response: %s\n", buffer);
 
-    //handles json format and retrieve co2 set level
-    char* json = strchr(buffer, '{');
-    if(!json){
-        return 0;
-    }
-    const char* command = R"("command_string":")";
-    char* set_number = strstr(json,command);
-    set_number += strlen(command);
-    char* end = strchr(set_number, '"');
-    if(end){
-        *end = '\0';
-        return (uint)atoi(set_number);
-    }
-
-    return 0;
+    //with nothing queued there is no command string and the level reads as 0
+    printf("Talkback command: %s\n", fields.value(0));
+    return (uint)atoi(fields.value(0));
 }
 
-//extract json from thingspeak http respond
-char* Network::extract_thingspeak_http_body(){
-    char* body = strstr(buffer, "\r\n\r\n");
-    if(body){
-        body += 4;
-        return body;
+//drops every queued talkback command with one request, commands left from before the boot are stale
+bool Network::clear_talkback(HttpClient &http){
+    const TxPart req{clear_request, sizeof(clear_request) - 1, true};
+
+    HttpResult rv = http.exchange(&req, 1, nullptr);
+    if(rv != HTTP_DONE || http.response().status != 200){
+        printf("Talkback queue not cleared %d\n", rv);
+        return false;
     }
-    return nullptr;
+    return true;
 }
 
 int Network::disconnect_to_http(IPStack &ip_stack){
@@ -4,41 +4,74 @@
 #include "../../FreeRTOS-KernelV10.6.2/include/queue.h"
 #include "../../FreeRTOS-KernelV10.6.2/include/task.h"
 #include "../ipstack/IPStack.h"
+#include "../ipstack/HttpClient.h"
+#include "../ipstack/JsonStream.h"
+#include "../ipstack/JsonFields.h"
 #include "../Structs.h"
+#include "../Task_Storage/Storage.h"
 #include <event_groups.h>
 
+// samples sent in one bulk update
+#define NETWORK_BATCH_MAX 32
+// samples gather this long between uploads
+#define NETWORK_UPLOAD_INTERVAL_MS 60000
+// shortest time between channel updates thingspeak accepts, used while a backlog is sent
+#define NETWORK_RATE_LIMIT_MS 15000
+// wait after a failed upload doubles from the rate limit up to this, with +-25 % jitter
+#define NETWORK_BACKOFF_MAX_MS (10 * 60 * 1000)
+
+// thingspeak account, the constant text of the requests is put together from these at compile time
+#define THINGSPEAK_HOST "api.thingspeak.com"
+#define THINGSPEAK_WRITE_API "7RC0GM5VZK7VRPN7"
+#define TALKBACK_API "WYYFXF0NGSZCUMW6"
+#define TALKBACK_ID "55392"
+
+// channel for bulk updates, from the environment like the wifi credentials
+#ifndef THINGSPEAK_CHANNEL_ID
+#define THINGSPEAK_CHANNEL_ID ""
+#endif
 
 class Network {
 public:
-    Network(QueueHandle_t to_CO2, QueueHandle_t to_UI, QueueHandle_t to_Network, EventGroupHandle_t network_event_group, uint32_t stack_size = 2048, UBaseType_t priority = tskIDLE_PRIORITY + 2);
+    Network(QueueHandle_t to_CO2, QueueHandle_t to_UI, QueueHandle_t to_Network, EventGroupHandle_t network_event_group, Storage &storage, uint32_t stack_size = 2048, UBaseType_t priority = tskIDLE_PRIORITY + 2);
     static void task_wrap(void *pvParameters);
-    char* extract_thingspeak_http_body();
 
 private:
     void task_impl();
     void load_wifi_cred();
     bool connect_to_http(IPStack &ip_stack);
     int disconnect_to_http(IPStack &ip_stack);
-    bool upload_data_to_cloud(IPStack &ip_stack, Monitored_data &data, uint co2_set);
-    uint read_co2_set_level(IPStack &ip_stack);
+    bool upload_cycle(IPStack &ip_stack, HttpClient &http);
+    uint32_t next_upload_ms(bool backlog);
+    void print_uplink_stats(IPStack &ip_stack);
+    bool upload_samples(HttpClient &http, const SampleRecord *samples, uint16_t count);
+    void write_samples(JsonStream &json, const SampleRecord *samples, uint16_t count, uint32_t now);
+    bool upload_data_to_cloud(HttpClient &http, const SampleRecord &sample, uint *command);
+    uint read_co2_set_level(HttpClient &http);
+    bool clear_talkback(HttpClient &http);
     bool connect_to_cloud(IPStack &ip_stack, const char* wifi_ssid, const char* wifi_password);
     QueueHandle_t to_CO2;
     QueueHandle_t to_UI;
     QueueHandle_t to_Network;
     uint co2_set;
     const char *name = "TESTTWO";
-    const char *host = "api.thingspeak.com";
+    const char *host = THINGSPEAK_HOST;
     const int port = 80; //http service
-    const char *write_api = "7RC0GM5VZK7VRPN7";
+    const char *write_api = THINGSPEAK_WRITE_API;
     const char *read_api = "9L9GPCBA6QG1ZC14";
-    static const int BUFSIZE = 2048;
-    char buffer[BUFSIZE];
+    const char *channel_id = THINGSPEAK_CHANNEL_ID;
+    SampleRecord batch[NETWORK_BATCH_MAX];
+    // uplink counters, queued and dropped samples are counted by the sample buffer in storage
+    uint32_t samples_sent = 0;
+    uint32_t samples_retried = 0;   // samples of failed uploads, sent again later
+    uint8_t failures_in_row = 0;
     const char *wifissid;
     const char *wifipass;
 
     bool wifi_connected = false;
     bool http_connected = false;
     EventGroupHandle_t network_event_group;
+    Storage &storage;
 
 };
 
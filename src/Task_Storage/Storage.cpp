@@ -0,0 +1,696 @@
+#include "Storage.h"
+#include "DeviceTime.h"
+#include "Rules/RuleCompiler.h"
+
+// rule text uploaded from the console, compiled when the upload ends
+static char rule_text[STORAGE_RULE_TEXT_MAX];
+
+// measurements logged every cycle repeat what the sample record carries, only state changes
+// and faults are worth their room in the flash history
+static bool history_event(EventCode code) {
+    return code != EV_CO2_MEASURED && code != EV_TRH_MEASURED;
+}
+
+Storage::Storage(uint32_t stack_size, UBaseType_t priority) {
+    requests = xQueueCreate(STORAGE_QUEUE_LENGTH, sizeof(StorageRequest));
+    call_access = xSemaphoreCreateMutex();
+    call_done = xSemaphoreCreateBinary();
+    bus_access = xSemaphoreCreateMutex();
+    config_access = xSemaphoreCreateMutex();
+    state = xEventGroupCreate();
+    xTaskCreate(task_wrap, name, stack_size, this, priority, nullptr);
+}
+
+void Storage::task_wrap(void *pvParameters) {
+    auto *storage = static_cast<Storage*>(pvParameters);
+    storage->task_impl();
+}
+
+void Storage::task_impl() {
+    auto i2cbus0 = std::make_shared<PicoI2C>(0, 100000);
+    eeprom = std::make_shared<EEPROM>(i2cbus0);
+    eeprom->begin();
+    uint32_t history_time;
+    bool history_found = history.begin(&history_time);
+#ifdef EEPROM_BENCHMARK
+    eeprom->benchmark();
+#endif
+
+    // timestamps continue from the newest stored record, done before any event is written.
+    // Samples come after the last event, the history keeps what an erase_all dropped and the
+    // EEPROM keeps what was still in the history page in RAM at a power cut
+    uint32_t newest = 0;
+    bool found = false;
+    uint32_t time;
+    if (eeprom->lastEventTime(&time)) {
+        newest = time;
+        found = true;
+    }
+    if (eeprom->lastSampleTime(&time) && (!found || time > newest)) {
+        newest = time;
+        found = true;
+    }
+    if (history_found && (!found || history_time > newest)) {
+        newest = history_time;
+        found = true;
+    }
+    if (found) {
+        DeviceTime::restore(newest);
+    }
+    load_config();
+    xEventGroupSetBits(state, STORAGE_READY_BIT);
+
+    static StorageRequest request;
+    while (true) {
+        // statuses are written once the queue has been drained, so repeated updates are merged
+        if (xQueueReceive(requests, &request, 0) != pdTRUE) {
+            write_statuses();
+            eeprom->flush();
+            // pages left over from an erase are cleaned one at a time while nothing else is queued
+            TickType_t wait = pdMS_TO_TICKS(scrub_pending ? STORAGE_SCRUB_INTERVAL_MS : STORAGE_CONSOLE_POLL_MS);
+            if (exporting) wait = 1;
+            if (xQueueReceive(requests, &request, wait) != pdTRUE) {
+                poll_console();
+                if (exporting) export_history();
+                if (scrub_pending) scrub_pending = eeprom->scrub();
+                bool bus_free = xSemaphoreTake(bus_access, 0) == pdTRUE;
+                history.maintain(bus_free);
+                if (bus_free) xSemaphoreGive(bus_access);
+                continue;
+            }
+        }
+        handle(request);
+    }
+}
+
+void Storage::handle(StorageRequest &request) {
+    bool ok = true;
+    switch (request.op) {
+        case ST_WRITE:
+            if (!eeprom->eepromWrite(request.address, request.data, request.len)) write_failed = true;
+            break;
+        case ST_STATUS:
+            keep_status(request);
+            break;
+        case ST_SETTING:
+            if (settings_pending & (1 << request.key)) merged++;
+            settings[request.key] = request.value;
+            settings_pending |= 1 << request.key;
+            break;
+        case ST_CONFIG:
+            if (config_dirty) merged++;
+            config_dirty = true;
+            break;
+        case ST_EVENT:
+            if (!eeprom->logEvent(request.code, request.zone, request.value)) write_failed = true;
+            if (history_event(request.code)) {
+                history.appendEvent(request.code, request.zone, request.value, DeviceTime::now());
+            }
+            break;
+        case ST_SAMPLE:
+            if (!eeprom->appendSample(*reinterpret_cast<const SampleRecord *>(request.data))) write_failed = true;
+            history.appendSample(*reinterpret_cast<const SampleRecord *>(request.data));
+            break;
+        case ST_PEEK_SAMPLES:
+            *request.count = eeprom->peekSamples(reinterpret_cast<SampleRecord *>(request.out), request.len);
+            break;
+        case ST_ACK_SAMPLES:
+            if (!eeprom->ackSamples(request.len)) write_failed = true;
+            break;
+        case ST_SAMPLE_STATS:
+            eeprom->sampleStats(reinterpret_cast<SampleStats *>(request.out));
+            break;
+        case ST_READ:
+            write_statuses();
+            ok = eeprom->eepromRead(request.address, request.out, request.len);
+            break;
+        case ST_READ_STATUS:
+            write_statuses();
+            ok = eeprom->readStatus(request.address, reinterpret_cast<char *>(request.out), request.len,
+                                    request.max_len);
+            break;
+        case ST_READ_SETTING:
+            write_statuses();
+            ok = eeprom->readSetting(request.key, reinterpret_cast<uint16_t *>(request.out));
+            break;
+        case ST_PRINT_LOGS:
+            eeprom->printAllLogs();
+            break;
+        case ST_DUMP_LOGS:
+            eeprom->dumpLogs();
+            break;
+        case ST_DELETE_LOGS:
+            eeprom->deleteLogs();
+            scrub_pending = true;
+            break;
+        case ST_ERASE_ALL:
+            erase_all();
+            break;
+        case ST_STATS:
+            eeprom->printStats();
+            history.printStats();
+            printf("Storage: %lu status writes merged, %u requests queued\n", merged,
+                   static_cast<unsigned>(uxQueueMessagesWaiting(requests)));
+            break;
+        case ST_SEEK_HISTORY:
+            history.seek(*request.cursor, request.from, request.to);
+            break;
+        case ST_READ_HISTORY: {
+            auto records = reinterpret_cast<HistoryRecord *>(request.out);
+            uint16_t count = 0;
+            while (count < request.len && request.cursor->next()) {
+                records[count++] = request.cursor->record();
+            }
+            *request.count = count;
+            break;
+        }
+        case ST_FLUSH:
+            write_statuses();
+            eeprom->flush();
+            break;
+        case ST_FENCE:
+            write_statuses();
+            history.flush();
+            ok = eeprom->sync() && !write_failed;
+            write_failed = false;
+            break;
+    }
+    if (request.result) {
+        *request.result = ok;
+        xSemaphoreGive(call_done);
+    }
+}
+
+// a later write of the same key replaces the waiting one
+void Storage::keep_status(const StorageRequest &request) {
+    PendingStatus *slot = nullptr;
+    for (auto &status: statuses) {
+        if (status.used && status.address == request.address) {
+            slot = &status;
+            merged++;
+            break;
+        }
+        if (!status.used && !slot) slot = &status;
+    }
+    if (!slot) {
+        // all keys are waiting, make room
+        write_statuses();
+        slot = &statuses[0];
+    }
+    slot->used = true;
+    slot->address = request.address;
+    slot->max_len = request.max_len;
+    std::memcpy(slot->value, request.data, sizeof(slot->value));
+}
+
+// writes the statuses and settings waiting in RAM
+void Storage::write_statuses() {
+    for (auto &status: statuses) {
+        if (status.used) {
+            if (!eeprom->writeStatus(status.address, status.value, status.max_len)) write_failed = true;
+            status.used = false;
+        }
+    }
+    for (uint8_t key = 0; key < SETTING_COUNT; key++) {
+        if (settings_pending & (1 << key)) {
+            if (!eeprom->writeSetting(static_cast<SettingKey>(key), settings[key])) write_failed = true;
+        }
+    }
+    settings_pending = 0;
+    if (config_dirty) {
+        write_config();
+    }
+}
+
+// both slots are read in one transaction and the newer valid block is used
+void Storage::load_config() {
+    static uint8_t slots[2 * CONFIG_SLOT_SIZE];
+    Config loaded[2];
+    uint32_t seq[2];
+    bool valid[2] = {};
+    if (eeprom->eepromRead(CONFIG_ADDR, slots, sizeof(slots))) {
+        for (int i = 0; i < 2; i++) {
+            valid[i] = loaded[i].parse(slots + i * CONFIG_SLOT_SIZE, CONFIG_SLOT_SIZE, &seq[i]);
+        }
+    }
+
+    int newest = -1;
+    for (int i = 0; i < 2; i++) {
+        if (valid[i] && (newest < 0 || static_cast<int32_t>(seq[i] - seq[newest]) > 0)) {
+            newest = i;
+        }
+    }
+
+    if (newest >= 0) {
+        config = loaded[newest];
+        config_seq = seq[newest];
+        printf("Config %lu loaded\n", config_seq);
+    } else if (migrate_config(loaded[0])) {
+        config = loaded[0];
+        config_dirty = true;
+        printf("Config migrated from status addresses\n");
+    } else {
+        printf("No config, using defaults\n");
+        config_dirty = true;
+    }
+}
+
+// settings of the old layout: ascii statuses at fixed addresses and the set level ring
+bool Storage::migrate_config(Config &legacy) {
+    char status[STR_BUFFER_SIZE];
+    bool found = false;
+    legacy = Config();
+
+    if (eeprom->readStatus(REBOOT_ADDR, status, sizeof(status))) {
+        if (strcmp(status, RUN_FLAG) == 0) legacy.set(CFG_RUN_STATE, RUN_STATE_RUNNING);
+        else if (strcmp(status, REBOOT_FLAG) == 0) legacy.set(CFG_RUN_STATE, RUN_STATE_STOPPED);
+        found = true;
+    }
+    uint16_t co2_set;
+    if (eeprom->readSetting(SETTING_CO2_SET, &co2_set)) {
+        legacy.set(CFG_CO2_SET, co2_set);
+        found = true;
+    } else if (eeprom->readStatus(CO2_SET_ADDR, status, sizeof(status))) {
+        legacy.set(CFG_CO2_SET, atoi(status));
+        found = true;
+    }
+    if (eeprom->readStatus(WIFI_SSID_ADDR, status, sizeof(status), STR_BUFFER_SIZE)) {
+        legacy.set(CFG_WIFI_SSID, status);
+        found = true;
+    }
+    if (eeprom->readStatus(WIFI_PASS_ADDR, status, sizeof(status), STR_BUFFER_SIZE)) {
+        legacy.set(CFG_WIFI_PASS, status);
+        found = true;
+    }
+    return found;
+}
+
+// slots are written in turn, a torn write leaves the previous block
+void Storage::write_config() {
+    static uint8_t block[CONFIG_SLOT_SIZE];
+    xSemaphoreTake(config_access, portMAX_DELAY);
+    size_t len = config.serialize(block, sizeof(block), config_seq + 1);
+    xSemaphoreGive(config_access);
+
+    config_dirty = false;
+    if (len == 0 || !eeprom->eepromWrite(CONFIG_ADDR + ((config_seq + 1) & 1) * CONFIG_SLOT_SIZE, block, len)) {
+        write_failed = true;
+        return;
+    }
+    config_seq++;
+}
+
+void Storage::poll_console() {
+    int c;
+    while ((c = getchar_timeout_us(0)) != PICO_ERROR_TIMEOUT) {
+        if (rules_entry) {
+            console_rules(c);
+        } else if (console_len > 0) {
+            // rest of a range query line
+            if (c == '\r' || c == '\n') {
+                console_line[console_len] = '\0';
+                console_len = 0;
+                console_range();
+            } else if (console_len < sizeof(console_line) - 1) {
+                console_line[console_len++] = static_cast<char>(c);
+            }
+        } else {
+            console_command(c);
+        }
+    }
+}
+
+void Storage::console_command(int c) {
+    switch (c) {
+        case 'l':
+            eeprom->printAllLogs();
+            break;
+        case 'd':
+            eeprom->dumpLogs();
+            break;
+        case 's':
+            eeprom->printStats();
+            history.printStats();
+            break;
+        case 'x':
+            history.open(export_cursor);
+            exporting = true;
+            printf("HISTORY BEGIN\n");
+            break;
+        case 'r':
+            console_line[0] = 'r';
+            console_len = 1;
+            break;
+        case 'u':
+            rules_entry = true;
+            rule_len = 0;
+            rule_overflow = false;
+            printf("enter rules, one per line, an empty line ends (and an empty upload clears the rules)\n");
+            break;
+        case 'c':
+            eeprom->deleteLogs();
+            scrub_pending = true;
+            printf("log cleared\n");
+            break;
+        case 'e':
+            erase_all();
+            printf("EEPROM erased\n");
+            break;
+        case '?':
+        case 'h':
+            printf("storage console: l = print log, d = dump log, s = statistics, x = export history,\n"
+                   "r FROM [TO] = export history between DeviceTime seconds, u = upload rules,\n"
+                   "c = clear log, e = erase all stored data\n");
+            break;
+        default:
+            break;
+    }
+}
+
+void Storage::console_range() {
+    unsigned long from;
+    unsigned long to = HISTORY_NO_TIME;
+    if (sscanf(console_line, "r %lu %lu", &from, &to) < 1) {
+        printf("usage: r FROM [TO]\n");
+        return;
+    }
+    history.seek(export_cursor, from, to);
+    exporting = true;
+    printf("HISTORY BEGIN\n");
+}
+
+// rule text is gathered a line at a time, an empty line ends it
+void Storage::console_rules(int c) {
+    if (c == '\r') return;
+    if (c == '\n' && (rule_len == 0 || rule_text[rule_len - 1] == '\n')) {
+        rule_text[rule_len] = '\0';
+        rules_entry = false;
+        store_rules();
+        return;
+    }
+    if (rule_len < sizeof(rule_text) - 1) {
+        rule_text[rule_len++] = static_cast<char>(c);
+    } else {
+        rule_overflow = true;
+    }
+}
+
+// the program is compiled straight into the EEPROM image behind its header
+void Storage::store_rules() {
+    static uint8_t image[RULES_SIZE];
+    if (rule_overflow) {
+        printf("rules not stored, longer than %d characters\n", STORAGE_RULE_TEXT_MAX - 1);
+        return;
+    }
+    RuleCompiler compiler;
+    size_t len = compiler.compile(rule_text, image + RULES_HEADER_SIZE, RULE_PROGRAM_MAX);
+    uint8_t count = 0;
+    if (len == 0 || !RuleEngine::verify(image + RULES_HEADER_SIZE, len, &count)) {
+        printf("rules not stored, line %d: %s\n", compiler.error_line(), compiler.error());
+        return;
+    }
+    EEPROM::rulesHeader(image, len);
+    if (!eeprom->eepromWrite(RULES_ADDR, image, len + RULES_HEADER_SIZE) || !eeprom->sync()) {
+        printf("rules not stored, EEPROM write failed\n");
+        return;
+    }
+    if (!eeprom->logEvent(EV_RULES_STORED, 0, count)) write_failed = true;
+    history.appendEvent(EV_RULES_STORED, 0, count, DeviceTime::now());
+    printf("%u rules stored (%u bytes)\n", count, static_cast<unsigned>(len));
+    xEventGroupSetBits(state, STORAGE_RULES_BIT);
+}
+
+// History lines, a few per idle round so queued requests aren't held up for long:
+// HS time zone co2 temperature humidity co2_set fan / HE time zone code value
+void Storage::export_history() {
+    for (int i = 0; i < STORAGE_EXPORT_BATCH; i++) {
+        if (!export_cursor.next()) {
+            printf("HISTORY END\n");
+            exporting = false;
+            return;
+        }
+        const HistoryRecord &record = export_cursor.record();
+        if (record.type == HISTORY_SAMPLE) {
+            printf("HS %lu %u %u %d %u %u %u\n", record.time, record.zone, record.value[0],
+                   static_cast<int16_t>(record.value[1]), record.value[2], record.value[3], record.aux);
+        } else if (record.type == HISTORY_EVENT) {
+            printf("HE %lu %u %u %u\n", record.time, record.zone, record.aux, record.value[0]);
+        }
+    }
+}
+
+// logical erase: statuses, settings and log are dropped by bumping the epochs, blocks with
+// their own crc (rules, snapshots) by zeroing their headers. Old pages are zeroed when idle
+void Storage::erase_all() {
+    uint8_t zero_header[8] = {};
+    // writes still waiting in RAM belong to the old epoch and must not reappear in the new one
+    for (auto &status: statuses) status.used = false;
+    settings_pending = 0;
+    if (!eeprom->erase() ||
+        !eeprom->eepromWrite(RULES_ADDR, zero_header, sizeof(zero_header)) ||
+        !eeprom->eepromWrite(SNAPSHOT_ADDR, zero_header, sizeof(zero_header)) ||
+        !eeprom->eepromWrite(SNAPSHOT_ADDR + SNAPSHOT_SLOT_SIZE, zero_header, sizeof(zero_header))) {
+        write_failed = true;
+    }
+    // the config goes back to defaults, written as the newest block
+    xSemaphoreTake(config_access, portMAX_DELAY);
+    config = Config();
+    xSemaphoreGive(config_access);
+    config_dirty = true;
+    scrub_pending = true;
+    // the stored rules are gone too, Control goes back to its built-in ones
+    xEventGroupSetBits(state, STORAGE_RULES_BIT);
+}
+
+void Storage::post(StorageRequest &request) {
+    request.result = nullptr;
+    xQueueSendToBack(requests, &request, portMAX_DELAY);
+}
+
+// queues a request and waits until the task has handled it
+bool Storage::call(StorageRequest &request) {
+    bool ok = false;
+    request.result = &ok;
+    xSemaphoreTake(call_access, portMAX_DELAY);
+    xQueueSendToBack(requests, &request, portMAX_DELAY);
+    xSemaphoreTake(call_done, portMAX_DELAY);
+    xSemaphoreGive(call_access);
+    return ok;
+}
+
+bool Storage::rulesChanged() {
+    return xEventGroupClearBits(state, STORAGE_RULES_BIT) & STORAGE_RULES_BIT;
+}
+
+void Storage::holdBus() {
+    xSemaphoreTake(bus_access, portMAX_DELAY);
+}
+
+void Storage::releaseBus() {
+    xSemaphoreGive(bus_access);
+}
+
+void Storage::waitReady() {
+    xEventGroupWaitBits(state, STORAGE_READY_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+}
+
+uint32_t Storage::getConfig(ConfigKey key) {
+    xSemaphoreTake(config_access, portMAX_DELAY);
+    uint32_t value = config.get(key);
+    xSemaphoreGive(config_access);
+    return value;
+}
+
+void Storage::getConfig(ConfigKey key, char *value, size_t len) {
+    xSemaphoreTake(config_access, portMAX_DELAY);
+    strncpy(value, config.get_str(key), len - 1);
+    value[len - 1] = '\0';
+    xSemaphoreGive(config_access);
+}
+
+// the mirror is updated at once, the block is written when the storage task gets to it
+void Storage::setConfig(ConfigKey key, uint32_t value) {
+    xSemaphoreTake(config_access, portMAX_DELAY);
+    bool changed = config.set(key, value);
+    xSemaphoreGive(config_access);
+    if (changed) {
+        StorageRequest request;
+        request.op = ST_CONFIG;
+        post(request);
+    }
+}
+
+void Storage::setConfig(ConfigKey key, const char *value) {
+    xSemaphoreTake(config_access, portMAX_DELAY);
+    bool changed = config.set(key, value);
+    xSemaphoreGive(config_access);
+    if (changed) {
+        StorageRequest request;
+        request.op = ST_CONFIG;
+        post(request);
+    }
+}
+
+void Storage::write(uint16_t address, const uint8_t *data, size_t len) {
+    StorageRequest request;
+    request.op = ST_WRITE;
+    while (len > 0) {
+        size_t chunk = len < STORAGE_DATA_MAX ? len : STORAGE_DATA_MAX;
+        request.address = address;
+        request.len = chunk;
+        std::memcpy(request.data, data, chunk);
+        post(request);
+        address += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+void Storage::writeStatus(uint16_t address, const char *status, size_t max_len) {
+    StorageRequest request;
+    request.op = ST_STATUS;
+    request.address = address;
+    request.max_len = max_len;
+    std::strncpy(reinterpret_cast<char *>(request.data), status, STR_BUFFER_SIZE - 1);
+    request.data[STR_BUFFER_SIZE - 1] = '\0';
+    post(request);
+}
+
+void Storage::writeSetting(SettingKey key, uint16_t value) {
+    StorageRequest request;
+    request.op = ST_SETTING;
+    request.key = key;
+    request.value = value;
+    post(request);
+}
+
+void Storage::logEvent(EventCode code, uint8_t zone, uint16_t value) {
+    StorageRequest request;
+    request.op = ST_EVENT;
+    request.code = code;
+    request.zone = zone;
+    request.value = value;
+    post(request);
+}
+
+void Storage::logSample(const SampleRecord &sample) {
+    StorageRequest request;
+    request.op = ST_SAMPLE;
+    std::memcpy(request.data, &sample, sizeof(sample));
+    post(request);
+}
+
+uint16_t Storage::peekSamples(SampleRecord *samples, uint16_t max) {
+    uint16_t count = 0;
+    StorageRequest request;
+    request.op = ST_PEEK_SAMPLES;
+    request.out = reinterpret_cast<uint8_t *>(samples);
+    request.len = max;
+    request.count = &count;
+    call(request);
+    return count;
+}
+
+void Storage::ackSamples(uint16_t count) {
+    StorageRequest request;
+    request.op = ST_ACK_SAMPLES;
+    request.len = count;
+    post(request);
+}
+
+void Storage::sampleStats(SampleStats *stats) {
+    StorageRequest request;
+    request.op = ST_SAMPLE_STATS;
+    request.out = reinterpret_cast<uint8_t *>(stats);
+    call(request);
+}
+
+bool Storage::read(uint16_t address, uint8_t *data, size_t len) {
+    StorageRequest request;
+    request.op = ST_READ;
+    request.address = address;
+    request.len = len;
+    request.out = data;
+    return call(request);
+}
+
+bool Storage::readStatus(uint16_t address, char *status_buffer, size_t buffer_len, size_t max_len) {
+    StorageRequest request;
+    request.op = ST_READ_STATUS;
+    request.address = address;
+    request.len = buffer_len;
+    request.max_len = max_len;
+    request.out = reinterpret_cast<uint8_t *>(status_buffer);
+    return call(request);
+}
+
+bool Storage::readSetting(SettingKey key, uint16_t *value) {
+    StorageRequest request;
+    request.op = ST_READ_SETTING;
+    request.key = key;
+    request.out = reinterpret_cast<uint8_t *>(value);
+    return call(request);
+}
+
+void Storage::printLogs() {
+    StorageRequest request;
+    request.op = ST_PRINT_LOGS;
+    post(request);
+}
+
+void Storage::dumpLogs() {
+    StorageRequest request;
+    request.op = ST_DUMP_LOGS;
+    post(request);
+}
+
+void Storage::deleteLogs() {
+    StorageRequest request;
+    request.op = ST_DELETE_LOGS;
+    post(request);
+}
+
+void Storage::eraseAll() {
+    StorageRequest request;
+    request.op = ST_ERASE_ALL;
+    post(request);
+}
+
+void Storage::printStats() {
+    StorageRequest request;
+    request.op = ST_STATS;
+    post(request);
+}
+
+void Storage::seekHistory(HistoryCursor &cursor, uint32_t from, uint32_t to) {
+    StorageRequest request;
+    request.op = ST_SEEK_HISTORY;
+    request.cursor = &cursor;
+    request.from = from;
+    request.to = to;
+    call(request);
+}
+
+uint16_t Storage::readHistory(HistoryCursor &cursor, HistoryRecord *records, uint16_t max) {
+    uint16_t count = 0;
+    StorageRequest request;
+    request.op = ST_READ_HISTORY;
+    request.cursor = &cursor;
+    request.out = reinterpret_cast<uint8_t *>(records);
+    request.len = max;
+    request.count = &count;
+    call(request);
+    return count;
+}
+
+void Storage::flush() {
+    StorageRequest request;
+    request.op = ST_FLUSH;
+    post(request);
+}
+
+bool Storage::fence() {
+    StorageRequest request;
+    request.op = ST_FENCE;
+    return call(request);
+}
@@ -0,0 +1,186 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "FreeRTOS.h"
+#include "queue.h"
+#include "semphr.h"
+#include "task.h"
+#include "EEPROM/EEPROM.h"
+#include "EEPROM/Config.h"
+#include "Flash/FlashHistory.h"
+#include <event_groups.h>
+#include <memory>
+
+#define STORAGE_QUEUE_LENGTH 16
+// data bytes carried by one write request, longer writes are split
+#define STORAGE_DATA_MAX EEPROM_PAGE_SIZE
+// status keys that can wait for writing at the same time
+#define STORAGE_STATUS_KEYS 4
+// pause between zeroing stale pages after an erase
+#define STORAGE_SCRUB_INTERVAL_MS 100
+// how often stdin is checked for console commands while idle
+#define STORAGE_CONSOLE_POLL_MS 200
+// history records printed per idle round while exporting
+#define STORAGE_EXPORT_BATCH 32
+// rule text that can be uploaded from the console
+#define STORAGE_RULE_TEXT_MAX 1024
+
+// set once the config has been loaded
+#define STORAGE_READY_BIT (1 << 0)
+// set when rules uploaded from the console have been stored, cleared by rulesChanged()
+#define STORAGE_RULES_BIT (1 << 1)
+
+enum StorageOp : uint8_t {
+    ST_WRITE,
+    ST_STATUS,
+    ST_SETTING,
+    ST_CONFIG,
+    ST_EVENT,
+    ST_SAMPLE,
+    ST_PEEK_SAMPLES,
+    ST_ACK_SAMPLES,
+    ST_SAMPLE_STATS,
+    ST_READ,
+    ST_READ_STATUS,
+    ST_READ_SETTING,
+    ST_PRINT_LOGS,
+    ST_DUMP_LOGS,
+    ST_DELETE_LOGS,
+    ST_ERASE_ALL,
+    ST_STATS,
+    ST_SEEK_HISTORY,
+    ST_READ_HISTORY,
+    ST_FLUSH,
+    ST_FENCE,
+};
+
+struct StorageRequest {
+    StorageOp op;
+    uint16_t address;
+    uint16_t len;           // data bytes, read length or status buffer length
+    uint16_t max_len;       // status slot size
+    SettingKey key;
+    EventCode code;
+    uint8_t zone;
+    uint16_t value;         // event or setting value
+    uint8_t *out;           // read destination
+    bool *result;           // set by synchronous requests
+    HistoryCursor *cursor;  // history range being read
+    uint32_t from;
+    uint32_t to;
+    uint16_t *count;        // history records or samples copied
+    uint8_t data[STORAGE_DATA_MAX];
+};
+
+// Low priority task that owns the EEPROM. Writes are queued and done behind the caller's back,
+// repeated writes of the same status key are merged into one. Reads and fence() wait for
+// the task, so they see every write queued before them.
+// Configuration is read from a RAM mirror that is loaded at start, changes are written through.
+// Logs are only read when asked for from the stdio console: l = print, d = raw dump for
+// tools/eventlog/decode_events.py, s = statistics, x = export the flash history,
+// r FROM [TO] = export a time range of it, u = upload control rules, which are compiled and
+// stored in place of the program in EEPROM, c = clear the log, e = erase everything in EEPROM.
+// Every sample also goes to the history in flash, which keeps far more than the EEPROM, and so do
+// the events apart from the per-cycle measurements the samples already hold.
+class Storage {
+public:
+    explicit Storage(uint32_t stack_size = 1024, UBaseType_t priority = tskIDLE_PRIORITY + 1);
+    static void task_wrap(void *pvParameters);
+
+    // waits until the config has been loaded
+    void waitReady();
+    uint32_t getConfig(ConfigKey key);
+    void getConfig(ConfigKey key, char *value, size_t len);
+    void setConfig(ConfigKey key, uint32_t value);
+    void setConfig(ConfigKey key, const char *value);
+
+    void write(uint16_t address, const uint8_t *data, size_t len);
+    void writeStatus(uint16_t address, const char *status, size_t max_len = STATUS_BUFF_SIZE);
+    void writeSetting(SettingKey key, uint16_t value);
+    void logEvent(EventCode code, uint8_t zone = 0, uint16_t value = 0);
+    // samples for the uplink, kept over outages and reboots
+    void logSample(const SampleRecord &sample);
+    // oldest samples the uplink hasn't confirmed, returns how many were copied
+    uint16_t peekSamples(SampleRecord *samples, uint16_t max);
+    void ackSamples(uint16_t count);
+    void sampleStats(SampleStats *stats);
+    bool read(uint16_t address, uint8_t *data, size_t len);
+    bool readStatus(uint16_t address, char *status_buffer, size_t buffer_len, size_t max_len = STATUS_BUFF_SIZE);
+    bool readSetting(SettingKey key, uint16_t *value);
+
+    // Time range queries over the flash history for other tasks: seekHistory positions the
+    // cursor, each readHistory copies the next records of the range, 0 at the end
+    void seekHistory(HistoryCursor &cursor, uint32_t from, uint32_t to = HISTORY_NO_TIME);
+    uint16_t readHistory(HistoryCursor &cursor, HistoryRecord *records, uint16_t max);
+
+    void printLogs();
+    void dumpLogs();
+    void deleteLogs();
+    void eraseAll();
+    void printStats();
+    // true once after new rules have been stored, the control task then loads them
+    bool rulesChanged();
+
+    // starts writing out everything queued so far, doesn't wait
+    void flush();
+    // waits until everything queued so far is on the chip, false if a write failed since the last fence
+    bool fence();
+    // held by the control task while it may use the Modbus bus. A history sector erase keeps
+    // interrupts off for 45 ms, long enough to overrun the UART, so it is done only when free
+    void holdBus();
+    void releaseBus();
+
+private:
+    void task_impl();
+    void handle(StorageRequest &request);
+    void post(StorageRequest &request);
+    bool call(StorageRequest &request);
+    void keep_status(const StorageRequest &request);
+    void write_statuses();
+    void erase_all();
+    void poll_console();
+    void console_command(int c);
+    void console_range();
+    void console_rules(int c);
+    void store_rules();
+    void export_history();
+    void load_config();
+    bool migrate_config(Config &legacy);
+    void write_config();
+
+    struct PendingStatus {
+        bool used;
+        uint16_t address;
+        uint16_t max_len;
+        char value[STR_BUFFER_SIZE];
+    };
+
+    const char *name = "STORAGE";
+    QueueHandle_t requests;
+    SemaphoreHandle_t call_access;  // one synchronous caller at a time
+    SemaphoreHandle_t call_done;
+    SemaphoreHandle_t bus_access;
+    std::shared_ptr<EEPROM> eeprom;
+    FlashHistory history;
+    HistoryCursor export_cursor;
+    bool exporting = false;
+    char console_line[32];
+    uint8_t console_len = 0;        // characters of a range query read so far
+    bool rules_entry = false;       // console lines are rule text until an empty line
+    uint16_t rule_len = 0;
+    bool rule_overflow = false;
+    EventGroupHandle_t state;
+
+    Config config;
+    SemaphoreHandle_t config_access;
+    uint32_t config_seq = 0;
+    bool config_dirty = false;
+    PendingStatus statuses[STORAGE_STATUS_KEYS] = {};
+    uint16_t settings[SETTING_COUNT] = {};
+    uint8_t settings_pending = 0;   // bit per key
+    bool write_failed = false;
+    bool scrub_pending = false;
+    uint32_t merged = 0;            // status and setting writes saved by merging
+};
+
+#endif //STORAGE_H
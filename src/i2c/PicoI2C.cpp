@@ -159,6 +159,10 @@ uint PicoI2C::transaction(uint8_t addr, const uint8_t *wbuffer, uint wlength, ui
     if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000)) == 0) {
         // timed out
         count = 0;
+    } else if (i2c->hw->raw_intr_stat & I2C_IC_RAW_INTR_STAT_TX_ABRT_BITS) {
+        // address or data was not acked, fifo was flushed so the counters don't tell it
+        (void) i2c->hw->clr_tx_abrt;
+        count = 0;
     } else {
         count -= rcnt + wctr;
     }
@@ -0,0 +1,221 @@
+#include "HttpClient.h"
+#include <cstring>
+#include <cstdlib>
+#include <strings.h>
+
+void HttpResponse::begin(JsonFields *body_fields) {
+    state = STATUS_LINE;
+    line_len = 0;
+    remaining = 0;
+    status = 0;
+    content_length = -1;
+    chunked = false;
+    keep_alive = true;
+    fields = body_fields;
+    body_len = 0;
+}
+
+size_t HttpResponse::feed(const uint8_t *data, size_t len) {
+    size_t used = 0;
+    while (used < len && state != COMPLETE && state != FAILED) {
+        if (state == BODY || state == CHUNK_DATA || state == BODY_TO_CLOSE) {
+            size_t take = len - used;
+            if (state != BODY_TO_CLOSE && take > remaining) take = remaining;
+            if (fields) fields->feed(data + used, take);
+            body_len += take;
+            used += take;
+            if (state == BODY_TO_CLOSE) continue;
+            remaining -= take;
+            if (remaining == 0) state = state == BODY ? COMPLETE : CHUNK_END;
+            continue;
+        }
+
+        // everything else is parsed a line at a time
+        char c = static_cast<char>(data[used++]);
+        if (c == '\n') {
+            if (line_len > 0 && line[line_len - 1] == '\r') line_len--;
+            line[line_len < HTTP_LINE_MAX ? line_len : HTTP_LINE_MAX - 1] = '\0';
+            line_len = 0;
+            if (!line_done()) state = FAILED;
+        } else if (line_len < HTTP_LINE_MAX) {
+            line[line_len++] = c;
+        }
+    }
+    return used;
+}
+
+bool HttpResponse::failed() const {
+    return state == FAILED;
+}
+
+bool HttpResponse::line_done() {
+    switch (state) {
+        case STATUS_LINE: {
+            if (strncmp(line, "HTTP/1.", 7) != 0) return false;
+            // HTTP/1.0 closes after the response unless asked not to
+            keep_alive = line[7] != '0';
+            const char *code = strchr(line, ' ');
+            if (!code) return false;
+            status = atoi(code + 1);
+            state = HEADERS;
+            return status >= 100;
+        }
+        case HEADERS:
+            if (line[0] == '\0') {
+                body_start();
+            } else if (char *colon = strchr(line, ':')) {
+                *colon = '\0';
+                const char *value = colon + 1;
+                while (*value == ' ' || *value == '\t') value++;
+                header(line, value);
+            }
+            return true;
+        case CHUNK_SIZE: {
+            // chunk extensions after ';' are ignored
+            char *end;
+            remaining = strtoul(line, &end, 16);
+            if (end == line) return false;
+            state = remaining > 0 ? CHUNK_DATA : TRAILERS;
+            return true;
+        }
+        case CHUNK_END:
+            state = CHUNK_SIZE;
+            return line[0] == '\0';
+        case TRAILERS:
+            if (line[0] == '\0') state = COMPLETE;
+            return true;
+        default:
+            return false;
+    }
+}
+
+void HttpResponse::header(const char *name, const char *value) {
+    if (strcasecmp(name, "Content-Length") == 0) {
+        content_length = strtol(value, nullptr, 10);
+    } else if (strcasecmp(name, "Transfer-Encoding") == 0) {
+        chunked = strstr(value, "chunked") != nullptr;
+    } else if (strcasecmp(name, "Connection") == 0) {
+        if (strcasecmp(value, "close") == 0) keep_alive = false;
+        else if (strcasecmp(value, "keep-alive") == 0) keep_alive = true;
+    }
+}
+
+void HttpResponse::body_start() {
+    if (status < 200) {
+        // interim response (100 Continue), the real one follows
+        state = STATUS_LINE;
+        content_length = -1;
+        chunked = false;
+    } else if (status == 204 || status == 304) {
+        state = COMPLETE;
+    } else if (chunked) {
+        state = CHUNK_SIZE;
+    } else if (content_length >= 0) {
+        remaining = content_length;
+        state = remaining > 0 ? BODY : COMPLETE;
+    } else {
+        keep_alive = false;
+        state = BODY_TO_CLOSE;
+    }
+}
+
+bool HttpResponse::closed() {
+    if (state == BODY_TO_CLOSE) state = COMPLETE;
+    return state == COMPLETE;
+}
+
+bool HttpResponse::complete() const {
+    return state == COMPLETE;
+}
+
+HttpClient::HttpClient(IPStack &ip_stack) : ip_stack(ip_stack) {}
+
+HttpResult HttpClient::start(const TxPart *request, size_t parts, JsonFields *fields, uint32_t timeout_ms) {
+    if (open(fields, timeout_ms) != HTTP_BUSY) return result;
+    return send(request, parts);
+}
+
+// the connection is kept between exchanges and opened again only when it was closed or lost
+HttpResult HttpClient::open(JsonFields *fields, uint32_t timeout_ms) {
+    if (ip_stack.ensure_connected() != ERR_OK) {
+        result = HTTP_ERR_SEND;
+        return result;
+    }
+
+    // whatever is left of an earlier response that timed out would be taken for this one
+    const uint8_t *stale;
+    while (size_t len = ip_stack.peek(&stale)) {
+        ip_stack.consume(len);
+    }
+
+    parser.begin(fields);
+    deadline = make_timeout_time_ms(timeout_ms);
+    result = HTTP_BUSY;
+    return result;
+}
+
+HttpResult HttpClient::send(const char *data, size_t len) {
+    TxPart part{data, len, false};
+    return send(&part, 1);
+}
+
+HttpResult HttpClient::send(const TxPart *parts, size_t count) {
+    if (result != HTTP_BUSY) return result;
+    if (ip_stack.write(parts, count) < 0) {
+        ip_stack.disconnect();
+        result = HTTP_ERR_SEND;
+    }
+    return result;
+}
+
+// takes whatever has arrived, doesn't wait
+HttpResult HttpClient::poll() {
+    if (result != HTTP_BUSY) return result;
+
+    // sampled before draining: data that came with the close is then parsed before it counts
+    bool closed = ip_stack.closed();
+    // spans are parsed where they lie in the receive buffer and then released
+    const uint8_t *data;
+    while (size_t len = ip_stack.peek(&data)) {
+        ip_stack.consume(parser.feed(data, len));
+        if (parser.failed()) {
+            result = HTTP_ERR_PARSE;
+            break;
+        }
+        if (parser.complete()) {
+            result = HTTP_DONE;
+            break;
+        }
+    }
+    if (result == HTTP_BUSY) {
+        if (closed) {
+            result = parser.closed() ? HTTP_DONE : HTTP_ERR_CLOSED;
+        } else if (time_reached(deadline)) {
+            result = HTTP_ERR_TIMEOUT;
+        }
+    }
+    // a failed exchange leaves the stream out of step, the next request starts on a new connection
+    if (result < 0 || (result == HTTP_DONE && !parser.keep_alive)) {
+        ip_stack.disconnect();
+    }
+    return result;
+}
+
+HttpResult HttpClient::exchange(const TxPart *request, size_t parts, JsonFields *fields, uint32_t timeout_ms) {
+    start(request, parts, fields, timeout_ms);
+    return wait();
+}
+
+HttpResult HttpClient::wait() {
+    HttpResult rv = poll();
+    while (rv == HTTP_BUSY) {
+        // woken by received data or the connection ending, not by a timer
+        ip_stack.wait_event(deadline);
+        rv = poll();
+    }
+    return rv;
+}
+
+const HttpResponse &HttpClient::response() const {
+    return parser;
+}
@@ -0,0 +1,102 @@
+#ifndef HTTPCLIENT_H
+#define HTTPCLIENT_H
+
+#include <cstdint>
+#include <cstddef>
+#include "IPStack.h"
+#include "JsonFields.h"
+
+// longest status or header line that is parsed, the rest of a longer line is skipped
+#define HTTP_LINE_MAX 128
+// time one exchange may take from sending the request to the end of the response
+#define HTTP_TIMEOUT_MS 5000
+
+enum HttpResult {
+    HTTP_BUSY = 0,
+    HTTP_DONE = 1,
+    HTTP_ERR_SEND = -1,     // request couldn't be queued
+    HTTP_ERR_TIMEOUT = -2,  // deadline passed before the response was complete
+    HTTP_ERR_CLOSED = -3,   // connection closed in the middle of the response
+    HTTP_ERR_PARSE = -4,    // not an HTTP/1.x response
+};
+
+// Incremental HTTP/1.1 response parser. Spans are fed in whatever pieces they arrive in and
+// the parser knows from the status line, Content-Length or chunked encoding when the response
+// is complete. Only the current status or header line is held, the body goes through to the
+// caller's JsonFields, which keeps the values it was asked for.
+class HttpResponse {
+public:
+    // fields may be null when the body isn't needed
+    void begin(JsonFields *body_fields);
+    // returns the bytes used, less than len once the response is complete
+    size_t feed(const uint8_t *data, size_t len);
+    bool failed() const;
+    // the peer closed the connection, completes a body that runs until close
+    bool closed();
+    bool complete() const;
+
+    int status = 0;
+    int32_t content_length = -1;    // -1 if not given
+    bool chunked = false;
+    bool keep_alive = true;         // false if the server closes after this response
+    size_t body_len = 0;
+
+private:
+    enum State : uint8_t {
+        STATUS_LINE,
+        HEADERS,
+        BODY,           // Content-Length bytes
+        BODY_TO_CLOSE,  // no length, the body ends when the connection does
+        CHUNK_SIZE,
+        CHUNK_DATA,
+        CHUNK_END,      // CRLF after chunk data
+        TRAILERS,
+        COMPLETE,
+        FAILED
+    };
+
+    bool line_done();
+    void header(const char *name, const char *value);
+    void body_start();
+
+    State state = STATUS_LINE;
+    char line[HTTP_LINE_MAX];
+    size_t line_len = 0;
+    uint32_t remaining = 0;         // bytes left of the body or the current chunk
+    JsonFields *fields = nullptr;
+};
+
+// Sends a request over the stack's connection and parses the response as it arrives. start()
+// waits only for room in the send buffer and poll() never waits, exchange() runs them until the
+// response is complete or the deadline passes, so a round trip takes as long as the network does.
+// Requests are given in parts so that their constant text is sent from flash. The response is parsed in place
+// in the stack's receive buffer, nothing of it is copied. Requests share one keep-alive
+// connection, which is opened again on the next request if it was closed or lost.
+class HttpClient {
+public:
+    explicit HttpClient(IPStack &ip_stack);
+
+    // fields of a JSON body to pick out, may be null
+    HttpResult start(const TxPart *request, size_t parts, JsonFields *fields,
+                     uint32_t timeout_ms = HTTP_TIMEOUT_MS);
+    // start() in pieces for requests written as they are encoded: open() once, then send()
+    // for each part of the request
+    HttpResult open(JsonFields *fields, uint32_t timeout_ms = HTTP_TIMEOUT_MS);
+    HttpResult send(const char *data, size_t len);
+    HttpResult send(const TxPart *parts, size_t count);
+    HttpResult poll();
+    // sleeps on the stack's callbacks until the response is complete or the deadline passes
+    HttpResult wait();
+    HttpResult exchange(const TxPart *request, size_t parts, JsonFields *fields,
+                        uint32_t timeout_ms = HTTP_TIMEOUT_MS);
+
+    const HttpResponse &response() const;
+
+private:
+    IPStack &ip_stack;
+    HttpResponse parser;
+    absolute_time_t deadline;
+    HttpResult result = HTTP_DONE;
+};
+
+#endif //HTTPCLIENT_H
@@ -8,8 +8,6 @@
 
 #include <projdefs.h>
 #include <lwip/dns.h>
-#include "FreeRTOS.h"
-#include "task.h"
 #include "portmacro.h"
 
 
@@ -19,7 +17,9 @@
 #define DUMP_BYTES(A, B) {}
 
 
-IPStack::IPStack() : tcp_pcb{nullptr}, dropped{0}, count{0}, wr{0}, rd{0}, tcp_connected{false},wifi_connected{false} {
+IPStack::IPStack() : tcp_pcb{nullptr}, rx_queue{nullptr}, tcp_state{TCP_IDLE}, host{}, host_port{0},
+    reconnect_count{0}, wifi_connected{false}, waiter{nullptr}, dns_pending{false}, signalled{false}, signal_us{0},
+    wake_count{0}, wake_total_us{0}, wake_max_us{0} {
 }
 
 bool IPStack::connect_WiFi(const char* ssid, const char* password, int max_retries){
@@ -78,35 +78,46 @@ int IPStack::connect(uint32_t hostname, int port) {
 }
 
 int IPStack::connect(const char *hostname, int port) {
+    // kept for reconnecting
+    if (hostname != host) {
+        strncpy(host, hostname, sizeof(host) - 1);
+        host_port = port;
+    }
+
+    // the task that connects is the one that waits for the callbacks
+    waiter = xTaskGetCurrentTaskHandle();
+
     // check if the hostname requires DNS resolution
     if (!ip4addr_aton(hostname, &remote_addr)) {
-        // dns for converting domain to ip address
-        ip_addr_t resolved;
-        err_t err;
-        int retries = 0;
-        // dns, retries for 5 times
-        do {
-            err = dns_gethostbyname(hostname, &resolved, NULL, NULL);
-            if (err == ERR_OK) {
-                printf("DNS success. %s\n", ipaddr_ntoa(&resolved));
-                remote_addr = resolved;
-                break;
-            } else if (err == ERR_INPROGRESS) {
-                vTaskDelay(pdMS_TO_TICKS(500));
-                retries++;
-            } else {
-                printf("DNS fail. %d\n", err);
+        // dns for converting domain to ip address, dns_found wakes us when the answer comes
+        dns_pending = true;
+        cyw43_arch_lwip_begin();
+        err_t err = dns_gethostbyname(hostname, &remote_addr, IPStack::dns_found, this);
+        cyw43_arch_lwip_end();
+        if (err == ERR_INPROGRESS) {
+            auto to = make_timeout_time_ms(IPSTACK_DNS_TIMEOUT_MS);
+            while (dns_pending && !time_reached(to)) {
+                wait_event(to);
+            }
+            if (dns_pending) {
+                dns_pending = false;
+                printf("DNS timeout\n");
                 return ERR_ARG;
             }
-        } while (retries < 5);
-
+            err = ip_addr_isany(&remote_addr) ? ERR_ARG : ERR_OK;
+        }
+        dns_pending = false;
         if (err != ERR_OK) {
-            printf("DNS timeout\n");
+            printf("DNS fail. %d\n", err);
             return ERR_ARG;
         }
+        printf("DNS success. %s\n", ipaddr_ntoa(&remote_addr));
     }
 
-    // open a socket connection
+    // open a socket connection, dropping the one left from before
+    if (tcp_pcb != nullptr) {
+        disconnect();
+    }
     DEBUG_printf("Connecting to %s port %u\n", ip4addr_ntoa(&remote_addr), port);
     //add lock
     cyw43_arch_lwip_begin();
@@ -123,6 +134,14 @@ int IPStack::connect(const char *hostname, int port) {
     tcp_sent(tcp_pcb, IPStack::tcp_client_sent);
     tcp_recv(tcp_pcb, IPStack::tcp_client_recv);
     tcp_err(tcp_pcb, IPStack::tcp_client_err);
+    // dead peers and connections dropped by a NAT are noticed while idle
+    ip_set_option(tcp_pcb, SOF_KEEPALIVE);
+    tcp_pcb->keep_idle = IPSTACK_KEEPALIVE_IDLE_MS;
+    tcp_pcb->keep_intvl = IPSTACK_KEEPALIVE_INTERVAL_MS;
+    tcp_pcb->keep_cnt = IPSTACK_KEEPALIVE_COUNT;
+    // bytes of an earlier connection don't belong to this one
+    drop_received();
+    tcp_state = TCP_CONNECTING;
 
     // cyw43_arch_lwip_begin/end should be used around calls into lwIP to ensure correct locking.
     // You can omit them if you are in a callback from lwIP. Note that when using pico_cyw_arch_poll
@@ -131,8 +150,36 @@ int IPStack::connect(const char *hostname, int port) {
     cyw43_arch_lwip_begin();
     err_t err = tcp_connect(tcp_pcb, &remote_addr, port, IPStack::tcp_client_connected);
     cyw43_arch_lwip_end();
+    if (err != ERR_OK) {
+        disconnect();
+        return err;
+    }
 
-    return err;
+    // the connected or err callback ends the wait
+    auto to = make_timeout_time_ms(IPSTACK_CONNECT_TIMEOUT_MS);
+    while (tcp_state == TCP_CONNECTING && !time_reached(to)) {
+        wait_event(to);
+    }
+    if (tcp_state != TCP_CONNECTED) {
+        DEBUG_printf("Connect failed, %s\n", tcp_state == TCP_CONNECTING ? "timeout" : "refused or reset");
+        disconnect();
+        return ERR_CONN;
+    }
+    return ERR_OK;
+}
+
+int IPStack::ensure_connected() {
+    if (tcp_state == TCP_CONNECTED || tcp_state == TCP_CONNECTING) {
+        return ERR_OK;
+    }
+    if (host[0] == '\0') {
+        return ERR_CONN;
+    }
+    DEBUG_printf("Reconnecting, connection was %s\n", tcp_state == TCP_IDLE ? "not open" :
+                 tcp_state == TCP_CLOSED ? "closed by peer" : "lost");
+    disconnect();
+    reconnect_count++;
+    return connect(host, host_port);
 }
 
 /** Function prototype for tcp sent callback functions. Called when sent data has
@@ -147,8 +194,9 @@ int IPStack::connect(const char *hostname, int port) {
  *            callback function!
  */
 err_t IPStack::tcp_client_sent(void *arg, struct tcp_pcb *tpcb, u16_t len) {
-    //auto state = static_cast<IPStack *>(arg);
-    DEBUG_printf("tcp_client_sent %u\n", len);
+    auto state = static_cast<IPStack *>(arg);
+    // acknowledged data made room in the send buffer for a write that is waiting
+    state->signal();
 
     return ERR_OK;
 }
@@ -170,7 +218,8 @@ err_t IPStack::tcp_client_connected(void *arg, struct tcp_pcb *tpcb, err_t err)
     if (err != ERR_OK) {
         printf("connect failed %d\n", err);
     }
-    state->tcp_connected = true;
+    state->tcp_state = TCP_CONNECTED;
+    state->signal();
 
     return ERR_OK;
 }
@@ -185,8 +234,8 @@ err_t IPStack::tcp_client_connected(void *arg, struct tcp_pcb *tpcb, err_t err)
  *            callback function!
  */
 err_t IPStack::tcp_client_poll(void *arg, struct tcp_pcb *tpcb) {
-    //auto state = static_cast<IPStack *>(arg);
-    DEBUG_printf("tcp_client_poll\n");
+    // the connection is kept open between requests, so this runs every few seconds for as
+    // long as it lives and has nothing to do
     return ERR_OK;
 }
 
@@ -201,7 +250,11 @@ err_t IPStack::tcp_client_poll(void *arg, struct tcp_pcb *tpcb) {
  *            ERR_RST: the connection was reset by the remote host
  */
 void IPStack::tcp_client_err(void *arg, err_t err) {
-    //auto state = static_cast<IPStack *>(arg);
+    auto state = static_cast<IPStack *>(arg);
+    // the pcb is gone, it must not be closed again
+    state->tcp_pcb = nullptr;
+    state->tcp_state = TCP_FAILED;
+    state->signal();
     if (err != ERR_ABRT) {
         DEBUG_printf("tcp_client_err %d\n", err);
         //state->tcp_result(err);
@@ -221,111 +274,222 @@ void IPStack::tcp_client_err(void *arg, err_t err) {
 err_t IPStack::tcp_client_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
     auto state = static_cast<IPStack *>(arg);
     if (!p) {
-        // connection has been closed - do we need to react to this somehow?
+        // connection has been closed, a response that runs until close is now complete
+        state->tcp_state = TCP_CLOSED;
+        state->signal();
         return ERR_OK;
     }
     // this method is callback from lwIP, so cyw43_arch_lwip_begin is not required, however you
     // can use this method to cause an assertion in debug mode, if this method is called when
     // cyw43_arch_lwip_begin IS needed
     cyw43_arch_lwip_check();
-    if (p->tot_len > 0) {
-#if 0
-        DEBUG_printf("recv %d err %d\n", p->tot_len, err);
-        for (struct pbuf *q = p; q != NULL; q = q->next) {
-            DUMP_BYTES(q->payload, q->len);
-        }
-#endif
-        // Receive the buffer
-        uint16_t available = BUF_SIZE - state->count;
-        uint16_t bytes_to_copy = available > p->tot_len ? p->tot_len : available;
-        uint16_t wr_end = state->wr + bytes_to_copy;
-        uint16_t first_copy = 0;
-
-        // check if bytes are to be dropped
-        if (bytes_to_copy < p->tot_len) {
-            state->dropped += p->tot_len - bytes_to_copy;
-        }
+    // the pbuf is kept as it is, tcp_recved is called when the reader has consumed it
+    if (state->rx_queue) {
+        pbuf_cat(state->rx_queue, p);
+    } else {
+        state->rx_queue = p;
+    }
+    state->signal();
 
-        if (wr_end > BUF_SIZE) {
-            // need to copy in two parts
-            first_copy = BUF_SIZE - state->wr; // calculate the size of first part to copy
-            if (first_copy) { //
-                bytes_to_copy -= pbuf_copy_partial(p, state->buffer + state->wr, first_copy, 0);
-                state->wr = 0; // start next copy from beginning
-            }
-            state->count += first_copy; // increment count by copied bytes
-            //printf("tot:%d, fc: %d, bc: %d, wr:%d\n", p->tot_len, first_copy, bytes_to_copy, state->wr);
-        }
-        state->wr += pbuf_copy_partial(p, state->buffer + state->wr, bytes_to_copy, first_copy);
-        state->wr %= BUF_SIZE; // wrap over
-        state->count += bytes_to_copy; // increment count by the rest of the copied bytes
+    return ERR_OK;
+}
+
+
+/** Called by lwIP when a name given to dns_gethostbyname has been resolved or the lookup failed.
+ *
+ * @param name The name that was looked up
+ * @param ipaddr The address of the name, NULL if it wasn't found
+ * @param arg The argument given to dns_gethostbyname
+ */
+void IPStack::dns_found(const char *name, const ip_addr_t *ipaddr, void *arg) {
+    auto state = static_cast<IPStack *>(arg);
+    // an answer that comes after connect gave up is ignored
+    if (!state->dns_pending) return;
+    if (ipaddr) {
+        state->remote_addr = *ipaddr;
+    } else {
+        ip_addr_set_zero(&state->remote_addr);
+    }
+    state->dns_pending = false;
+    state->signal();
+}
 
-        tcp_recved(tpcb, p->tot_len);
+// wakes the task waiting in wait_event, the callbacks run in the lwIP task so this isn't from an ISR
+void IPStack::signal() {
+    if (!signalled) {
+        signal_us = time_us_32();
+        signalled = true;
+    }
+    if (waiter) {
+        xTaskNotifyGive(waiter);
     }
-    pbuf_free(p); // can we omit this call instead of dropping bytes to save the buffer for copying the rest later?
+}
 
-    return ERR_OK;
+bool IPStack::wait_event(absolute_time_t until) {
+    if (waiter == nullptr) {
+        waiter = xTaskGetCurrentTaskHandle();
+    }
+    int64_t left_us = absolute_time_diff_us(get_absolute_time(), until);
+    if (left_us <= 0) {
+        return false;
+    }
+    // one tick more so the wait doesn't end just before the deadline
+    if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(left_us / 1000) + 1) == 0) {
+        return false;
+    }
+    if (signalled) {
+        uint32_t latency = time_us_32() - signal_us;
+        signalled = false;
+        wake_count++;
+        wake_total_us += latency;
+        if (latency > wake_max_us) wake_max_us = latency;
+    }
+    return true;
 }
 
+void IPStack::wake_latency(uint32_t *avg_us, uint32_t *max_us) const {
+    *avg_us = wake_count ? wake_total_us / wake_count : 0;
+    *max_us = wake_max_us;
+}
 
 int IPStack::read(unsigned char *buffer, int len, int timeout) {
-    // is it possible to call with zero timeout?
+    // sleeps until the receive callback has brought enough, the connection ends or time is up
     auto to = make_timeout_time_ms(timeout);
-    do {
-        cyw43_arch_poll();
-    } while (count < len && !time_reached(to));
-
-    uint16_t first_copy = 0;
-    int bytes_to_copy = count < len ? count : len;
-    if (bytes_to_copy) {
-        uint16_t rd_end = rd + bytes_to_copy;
-        if (rd_end > BUF_SIZE) {
-            // need to copy in two parts
-            first_copy = BUF_SIZE - rd; // calculate the size of the first part to copy
-            if (first_copy) { //
-                std::memcpy(buffer, this->buffer + rd, first_copy);
-                bytes_to_copy -= first_copy;
-                count -= first_copy; // reduce count by copied bytes
-            }
-            // start from beginning
-            std::memcpy(buffer + first_copy, this->buffer, bytes_to_copy);
-            rd = bytes_to_copy;
-            //printf("read: fc: %d, bc: %d, len:%d\n", first_copy, bytes_to_copy, len);
-        } else {
-            std::memcpy(buffer, this->buffer + rd, bytes_to_copy);
-            rd = (rd + bytes_to_copy) % BUF_SIZE;
-        }
-        count -= bytes_to_copy; // reduce count by the rest of the copied bytes
+    while (available() < static_cast<size_t>(len) && !closed() && !time_reached(to)) {
+        wait_event(to);
     }
-    // return count of copied bytes
-    return bytes_to_copy+first_copy;
+
+    int copied = 0;
+    const uint8_t *data;
+    while (copied < len) {
+        size_t span = peek(&data);
+        if (span == 0) break;
+        if (span > static_cast<size_t>(len - copied)) span = len - copied;
+        std::memcpy(buffer + copied, data, span);
+        consume(span);
+        copied += span;
+    }
+    return copied;
 }
 
-int IPStack::write(unsigned char *buffer, int len) {
-    int rv = len;
-    // cyw43_arch_lwip_begin/end should be used around calls into lwIP to ensure correct locking.
-    // You can omit them if you are in a callback from lwIP. Note that when using pico_cyw_arch_poll
-    // these calls are a no-op and can be omitted, but it is a good practice to use them in
-    // case you switch the cyw43_arch type later.
+size_t IPStack::peek(const uint8_t **data) {
+    // the recv callback only adds to the end of the queue, the first pbuf stays as it is
     cyw43_arch_lwip_begin();
+    // lwIP leaves empty pbufs at the front of a segment it trimmed after a retransmission
+    while (rx_queue && rx_queue->len == 0 && rx_queue->next) {
+        struct pbuf *empty = rx_queue;
+        rx_queue = empty->next;
+        empty->next = nullptr;
+        pbuf_free(empty);
+    }
+    size_t len = rx_queue ? rx_queue->len : 0;
+    *data = rx_queue ? static_cast<const uint8_t *>(rx_queue->payload) : nullptr;
+    cyw43_arch_lwip_end();
+    return len;
+}
 
-    err_t err = tcp_write(tcp_pcb, buffer, len, TCP_WRITE_FLAG_COPY);
-    if (err != ERR_OK) {
-        DEBUG_printf("Failed to write data %d\n", err);
-        rv = -1;
+void IPStack::consume(size_t len) {
+    cyw43_arch_lwip_begin();
+    if (rx_queue) {
+        // frees the pbufs that were read through and moves the payload of a partly read one
+        rx_queue = pbuf_free_header(rx_queue, len);
+        // the window opens again by what was read
+        if (tcp_pcb) tcp_recved(tcp_pcb, len);
     }
-    // headers suggest that this should be called to make sure that data is sent right away
-    // however there is TCB_WRITE_FLAG_MORE that possibly indicates the same thing??
-    if (tcp_output(tcp_pcb) != ERR_OK) {
-        // failed! What should I do now?
-        rv = -2;
+    cyw43_arch_lwip_end();
+}
+
+size_t IPStack::available() {
+    cyw43_arch_lwip_begin();
+    size_t len = rx_queue ? rx_queue->tot_len : 0;
+    cyw43_arch_lwip_end();
+    return len;
+}
+
+// unread data of a connection that is being dropped
+void IPStack::drop_received() {
+    cyw43_arch_lwip_begin();
+    if (rx_queue) {
+        pbuf_free(rx_queue);
+        rx_queue = nullptr;
+    }
+    cyw43_arch_lwip_end();
+}
+
+int IPStack::write(unsigned char *buffer, int len) {
+    TxPart part{buffer, static_cast<size_t>(len), false};
+    return write(&part, 1);
+}
+
+int IPStack::write(const TxPart *parts, size_t count) {
+    auto to = make_timeout_time_ms(IPSTACK_SEND_TIMEOUT_MS);
+    int written = 0;
+    for (size_t i = 0; i < count; i++) {
+        auto data = static_cast<const uint8_t *>(parts[i].data);
+        size_t left = parts[i].len;
+        while (left > 0) {
+            // cyw43_arch_lwip_begin/end should be used around calls into lwIP to ensure correct locking.
+            // You can omit them if you are in a callback from lwIP. Note that when using pico_cyw_arch_poll
+            // these calls are a no-op and can be omitted, but it is a good practice to use them in
+            // case you switch the cyw43_arch type later.
+            cyw43_arch_lwip_begin();
+            if (tcp_pcb == nullptr) {
+                cyw43_arch_lwip_end();
+                return -1;
+            }
+            size_t room = tcp_sndbuf(tcp_pcb);
+            size_t len = left < room ? left : room;
+            err_t err = ERR_MEM;
+            if (len > 0) {
+                // MORE keeps PSH off until the last part, so the pieces go out as full segments
+                u8_t flags = parts[i].constant ? 0 : TCP_WRITE_FLAG_COPY;
+                if (len < left || i + 1 < count) flags |= TCP_WRITE_FLAG_MORE;
+                err = tcp_write(tcp_pcb, data, len, flags);
+            }
+            if (err == ERR_OK) {
+                data += len;
+                left -= len;
+                written += len;
+            } else if (err != ERR_MEM) {
+                DEBUG_printf("Failed to write data %d\n", err);
+                cyw43_arch_lwip_end();
+                return -1;
+            }
+            if (err == ERR_MEM || left > 0) {
+                // the send buffer or queue is full, send what is queued and wait for acks
+                tcp_output(tcp_pcb);
+            }
+            cyw43_arch_lwip_end();
+
+            if (err == ERR_MEM && !wait_event(to)) {
+                DEBUG_printf("Write timed out, %u bytes left\n", static_cast<unsigned>(left));
+                return -1;
+            }
+        }
     }
 
+    cyw43_arch_lwip_begin();
+    int rv = written;
+    if (tcp_pcb == nullptr || tcp_output(tcp_pcb) != ERR_OK) {
+        rv = -2;
+    }
     cyw43_arch_lwip_end();
 
     return rv;
 }
 
+bool IPStack::closed() const {
+    return tcp_state == TCP_CLOSED || tcp_state == TCP_FAILED;
+}
+
+TcpState IPStack::state() const {
+    return tcp_state;
+}
+
+uint32_t IPStack::reconnects() const {
+    return reconnect_count;
+}
+
 int IPStack::disconnect() {
     cyw43_arch_lwip_begin();
 
@@ -344,7 +508,9 @@ int IPStack::disconnect() {
         }
         tcp_pcb = nullptr;
     }
+    tcp_state = TCP_IDLE;
     cyw43_arch_lwip_end();
+    drop_received();
     return err;
 }
 
@@ -361,7 +527,7 @@ void IPStack::disconnect_WiFi() {
     cyw43_arch_lwip_end();
 
     wifi_connected = false;
-    tcp_connected = false;
+    tcp_state = TCP_IDLE;
 
     DEBUG_printf("WiFi disconnected.\n");
 }
\ No newline at end of file
@@ -12,7 +12,36 @@
 
 #include "lwip/pbuf.h"
 #include "lwip/tcp.h"
+#include "FreeRTOS.h"
+#include "task.h"
 
+// idle time before the first keepalive probe, then probes every interval until count go unanswered
+#define IPSTACK_KEEPALIVE_IDLE_MS 30000
+#define IPSTACK_KEEPALIVE_INTERVAL_MS 5000
+#define IPSTACK_KEEPALIVE_COUNT 3
+#define IPSTACK_HOST_MAX 64
+#define IPSTACK_DNS_TIMEOUT_MS 5000
+#define IPSTACK_CONNECT_TIMEOUT_MS 10000
+// longest wait for the peer to acknowledge enough to make room for the rest of a write
+#define IPSTACK_SEND_TIMEOUT_MS 5000
+
+// connection state, updated from the lwIP callbacks
+enum TcpState : uint8_t {
+    TCP_IDLE,       // no connection
+    TCP_CONNECTING,
+    TCP_CONNECTED,
+    TCP_CLOSED,     // the peer closed its side, our pcb is still open
+    TCP_FAILED      // reset, keepalive timeout or connect failure, lwIP has freed the pcb
+};
+
+// one piece of a scatter-gather write. Constant data, such as string literals in flash, stays
+// valid until the peer has acknowledged it, so lwIP sends it from where it is. Anything else is
+// copied into the send buffer
+struct TxPart {
+    const void *data;
+    size_t len;
+    bool constant;
+};
 
 class IPStack {
 public:
@@ -24,9 +53,31 @@ public:
 
     int connect(const char *hostname, int port);
     int connect(uint32_t hostname, int port);
+    // opens the connection again to the last host if it was closed or lost, kept open otherwise
+    int ensure_connected();
     int read(unsigned char *buffer, int len, int timeout);
+    // Sleeps until one of the callbacks signals the connection's task or the deadline passes,
+    // false on timeout. Wakes can be spurious, the caller checks what it waited for
+    bool wait_event(absolute_time_t until);
+    // Zero-copy reading: peek gives the received bytes at the read position that are in one
+    // pbuf, they stay in place until consume releases them. 0 if nothing is waiting.
+    // Received data is acknowledged to the peer only when it is consumed, so a slow reader
+    // closes the TCP window instead of losing bytes
+    size_t peek(const uint8_t **data);
+    void consume(size_t len);
+    // bytes received and not consumed yet
+    size_t available();
     int write(unsigned char *buffer, int len);
+    // Queues the parts as one stream and sends them. When the send buffer is full it waits for
+    // the sent callback to make room. Returns the bytes written or < 0 if the connection failed
+    int write(const TxPart *parts, size_t count);
     int disconnect();
+    // the peer closed the connection or it was reset
+    bool closed() const;
+    TcpState state() const;
+    uint32_t reconnects() const;
+    // time from a callback signalling to the waiting task running again
+    void wake_latency(uint32_t *avg_us, uint32_t *max_us) const;
     // added disconnection from wifi
     void disconnect_WiFi();
     // lwip callback functions
@@ -35,19 +86,31 @@ public:
     static void tcp_client_err(void *arg, err_t err);
     static err_t tcp_client_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err);
     static err_t tcp_client_connected(void *arg, struct tcp_pcb *tpcb, err_t err);
+    static void dns_found(const char *name, const ip_addr_t *ipaddr, void *arg);
 
-    static const int BUF_SIZE{2048};
     static const int POLL_TIME_S{5};
 private:
+    void signal();
+    void drop_received();
+
     struct tcp_pcb *tcp_pcb;
     ip_addr_t remote_addr;
-    uint8_t buffer[BUF_SIZE];
-    uint16_t count;
-    uint32_t dropped;
-    uint16_t wr; // write index
-    uint16_t rd; // read index
-    bool tcp_connected;
+    // pbufs handed over by the recv callback, chained in arrival order. The payload of the
+    // first one is moved past the bytes consumed from it. TCP_WND bounds the total
+    struct pbuf *rx_queue;
+    volatile TcpState tcp_state;
+    char host[IPSTACK_HOST_MAX];
+    int host_port;
+    uint32_t reconnect_count;
     bool wifi_connected;
+    // task that opened the connection, the callbacks notify it instead of it polling
+    TaskHandle_t waiter;
+    volatile bool dns_pending;
+    volatile bool signalled;
+    volatile uint32_t signal_us; // when the first callback since the last wake signalled
+    uint32_t wake_count;
+    uint32_t wake_total_us;
+    uint32_t wake_max_us;
 };
 
 
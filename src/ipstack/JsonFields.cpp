@@ -0,0 +1,112 @@
+#include "JsonFields.h"
+#include <cstring>
+
+void JsonFields::begin(const char *const *field_names, uint8_t count) {
+    names = field_names;
+    name_count = count < JSON_FIELDS_MAX ? count : JSON_FIELDS_MAX;
+    state = SCAN;
+    token_len = 0;
+    field = -1;
+    found_bits = 0;
+    for (auto &value: values) value[0] = '\0';
+}
+
+void JsonFields::feed(const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        take(static_cast<char>(data[i]));
+    }
+}
+
+void JsonFields::take(char c) {
+    switch (state) {
+        case SCAN:
+            if (c == '"') {
+                token_len = 0;
+                state = STRING;
+            }
+            break;
+        case STRING:
+            if (c == '\\') {
+                state = STRING_ESCAPE;
+            } else if (c == '"') {
+                token[token_len] = '\0';
+                state = AFTER_STRING;
+            } else if (token_len < JSON_TOKEN_MAX) {
+                token[token_len++] = c;
+            }
+            break;
+        case STRING_ESCAPE:
+            if (token_len < JSON_TOKEN_MAX) token[token_len++] = c;
+            state = STRING;
+            break;
+        case AFTER_STRING:
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\n') break;
+            if (c == ':') {
+                field = static_cast<int8_t>(match());
+                state = field >= 0 ? VALUE_START : SCAN;
+            } else {
+                // the string was a value, this character starts the next token
+                state = SCAN;
+                take(c);
+            }
+            break;
+        case VALUE_START:
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\n') break;
+            token_len = 0;
+            if (c == '"') {
+                state = VALUE_STRING;
+            } else {
+                state = VALUE_LITERAL;
+                keep(c);
+            }
+            break;
+        case VALUE_STRING:
+            if (c == '\\') {
+                state = VALUE_ESCAPE;
+            } else if (c == '"') {
+                value_done();
+            } else {
+                keep(c);
+            }
+            break;
+        case VALUE_ESCAPE:
+            keep(c);
+            state = VALUE_STRING;
+            break;
+        case VALUE_LITERAL:
+            if (c == ',' || c == '}' || c == ']' || c == ' ' || c == '\r' || c == '\n') {
+                value_done();
+            } else {
+                keep(c);
+            }
+            break;
+    }
+}
+
+void JsonFields::keep(char c) {
+    if (token_len < JSON_VALUE_MAX) values[field][token_len++] = c;
+}
+
+void JsonFields::value_done() {
+    if (!(found_bits & (1 << field))) {
+        values[field][token_len] = '\0';
+        found_bits |= 1 << field;
+    }
+    state = SCAN;
+}
+
+int JsonFields::match() const {
+    for (uint8_t i = 0; i < name_count; i++) {
+        // a later occurrence of a field that was found must not overwrite the value
+        if (!(found_bits & (1 << i)) && strcmp(token, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+bool JsonFields::found(uint8_t field) const {
+    return field < name_count && (found_bits & (1 << field));
+}
+
+const char *JsonFields::value(uint8_t field) const {
+    return found(field) ? values[field] : "";
+}
@@ -0,0 +1,51 @@
+#ifndef JSONFIELDS_H
+#define JSONFIELDS_H
+
+#include <cstdint>
+#include <cstddef>
+
+#define JSON_FIELDS_MAX 4
+// longest key that is compared and longest value that is kept, longer ones are cut
+#define JSON_TOKEN_MAX 24
+#define JSON_VALUE_MAX 24
+
+// Picks named fields out of a JSON body as it streams past, without keeping the body. Keys
+// are matched at any depth, the first occurrence wins. Values are kept as text: strings
+// without their quotes, numbers and literals as written.
+class JsonFields {
+public:
+    // names are not copied and must outlive the scan
+    void begin(const char *const *field_names, uint8_t count);
+    void feed(const uint8_t *data, size_t len);
+    bool found(uint8_t field) const;
+    // empty if the field wasn't found
+    const char *value(uint8_t field) const;
+
+private:
+    enum State : uint8_t {
+        SCAN,           // between tokens
+        STRING,         // in a string that may be a key
+        STRING_ESCAPE,
+        AFTER_STRING,   // a ':' makes the string a key
+        VALUE_START,
+        VALUE_STRING,
+        VALUE_ESCAPE,
+        VALUE_LITERAL
+    };
+
+    void take(char c);
+    void keep(char c);
+    void value_done();
+    int match() const;
+
+    const char *const *names = nullptr;
+    uint8_t name_count = 0;
+    State state = SCAN;
+    char token[JSON_TOKEN_MAX + 1];
+    uint8_t token_len = 0;
+    int8_t field = -1;      // field whose value is being read
+    uint8_t found_bits = 0;
+    char values[JSON_FIELDS_MAX][JSON_VALUE_MAX + 1];
+};
+
+#endif //JSONFIELDS_H
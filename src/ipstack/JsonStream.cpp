@@ -0,0 +1,111 @@
+#include "JsonStream.h"
+#include <cstdio>
+#include <cstring>
+
+JsonStream::JsonStream(HttpClient *http) : http(http) {}
+
+void JsonStream::begin_object(const char *key) {
+    separator(key);
+    put("{");
+    open_level();
+}
+
+void JsonStream::end_object() {
+    depth--;
+    put("}");
+}
+
+void JsonStream::begin_array(const char *key) {
+    separator(key);
+    put("[");
+    open_level();
+}
+
+void JsonStream::end_array() {
+    depth--;
+    put("]");
+}
+
+void JsonStream::value(const char *key, int32_t number) {
+    char text[12];
+    separator(key);
+    put(text, snprintf(text, sizeof(text), "%ld", static_cast<long>(number)));
+}
+
+void JsonStream::value(const char *key, const char *text) {
+    separator(key);
+    string(text);
+}
+
+void JsonStream::tenths(const char *key, int32_t number) {
+    char text[14];
+    uint32_t magnitude = number < 0 ? -number : number;
+    separator(key);
+    put(text, snprintf(text, sizeof(text), "%s%lu.%lu", number < 0 ? "-" : "",
+                       static_cast<unsigned long>(magnitude / 10), static_cast<unsigned long>(magnitude % 10)));
+}
+
+// a level deeper than JSON_DEPTH_MAX has no bit to track its commas, the document is refused
+void JsonStream::open_level() {
+    if (depth == JSON_DEPTH_MAX) {
+        failed = true;
+    } else {
+        has_items &= ~(1u << (depth + 1));
+    }
+    depth++;
+}
+
+void JsonStream::separator(const char *key) {
+    uint32_t level = depth <= JSON_DEPTH_MAX ? 1u << depth : 0;
+    if (has_items & level) put(",");
+    has_items |= level;
+    if (key) {
+        string(key);
+        put(":");
+    }
+}
+
+// quotes and backslashes are escaped, control characters dropped
+void JsonStream::string(const char *text) {
+    put("\"");
+    for (const char *c = text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            char escaped[2] = {'\\', *c};
+            put(escaped, 2);
+        } else if (static_cast<unsigned char>(*c) >= 0x20) {
+            put(c, 1);
+        }
+    }
+    put("\"");
+}
+
+void JsonStream::put(const char *text, size_t len) {
+    total += len;
+    if (!http) return;
+    while (len > 0) {
+        size_t take = sizeof(buffer) - used < len ? sizeof(buffer) - used : len;
+        std::memcpy(buffer + used, text, take);
+        used += take;
+        text += take;
+        len -= take;
+        if (used == sizeof(buffer)) flush();
+    }
+}
+
+void JsonStream::put(const char *text) {
+    put(text, strlen(text));
+}
+
+void JsonStream::flush() {
+    if (used > 0 && http->send(buffer, used) < 0) failed = true;
+    used = 0;
+}
+
+bool JsonStream::finish() {
+    if (http) flush();
+    return !failed;
+}
+
+size_t JsonStream::length() const {
+    return total;
+}
@@ -0,0 +1,53 @@
+#ifndef JSONSTREAM_H
+#define JSONSTREAM_H
+
+#include <cstdint>
+#include <cstddef>
+#include "HttpClient.h"
+
+#define JSON_STREAM_BUFFER 256
+// nesting levels of objects and arrays, a document nested deeper fails
+#define JSON_DEPTH_MAX 8
+static_assert(JSON_DEPTH_MAX < 32, "a bit per nesting level must fit in has_items");
+
+// Writes a JSON document as it is produced. Text is gathered in a small buffer that goes to
+// the HTTP client whenever it fills, so the document is never held whole in RAM. Without a
+// client the text is only counted, which gives the Content-Length before the body is sent
+// by a second pass with the same calls.
+class JsonStream {
+public:
+    explicit JsonStream(HttpClient *http = nullptr);
+
+    // key is given for members of an object and left out for array elements
+    void begin_object(const char *key = nullptr);
+    void end_object();
+    void begin_array(const char *key = nullptr);
+    void end_array();
+    void value(const char *key, int32_t number);
+    void value(const char *key, const char *text);
+    // number in tenths, written with one decimal
+    void tenths(const char *key, int32_t number);
+
+    // sends what is left in the buffer, false if any part couldn't be sent
+    bool finish();
+    // bytes written so far
+    size_t length() const;
+
+private:
+    void open_level();
+    void separator(const char *key);
+    void string(const char *text);
+    void put(const char *text, size_t len);
+    void put(const char *text);
+    void flush();
+
+    HttpClient *http;
+    char buffer[JSON_STREAM_BUFFER];
+    size_t used = 0;
+    size_t total = 0;
+    uint8_t depth = 0;
+    uint32_t has_items = 0; // bit per level: a member was written, the next one needs a comma
+    bool failed = false;
+};
+
+#endif //JSONSTREAM_H
@@ -20,12 +20,21 @@ uint16_t ModbusRegister::read() {
     return value;
 }
 
-void ModbusRegister::write(uint16_t value) {
+bool ModbusRegister::read(uint16_t *values, uint16_t count) {
+    client->set_destination_rtu_address(server);
+    nmbs_error err;
+    if(hr) err = client->read_holding_registers(reg_addr, count, values);
+    else err = client->read_input_registers(reg_addr, count, values);
+    return err == NMBS_ERROR_NONE;
+}
+
+bool ModbusRegister::write(uint16_t value) {
     // only holding register is writable
     if(hr){
         // With RTU one client handles all devices (servers) on the same bus
         // so we need to set the server address
         client->set_destination_rtu_address(server);
-        client->write_single_register(reg_addr, value);
+        return client->write_single_register(reg_addr, value) == NMBS_ERROR_NONE;
     }
+    return false;
 }
@@ -12,7 +12,9 @@ class ModbusRegister {
 public:
     ModbusRegister(std::shared_ptr<ModbusClient> client_, int server_address, int register_address, bool holding_register = true);
     uint16_t read();
-    void write(uint16_t value);
+    // reads count consecutive registers starting from this one in a single transaction
+    bool read(uint16_t *values, uint16_t count);
+    bool write(uint16_t value);
 private:
     std::shared_ptr<ModbusClient> client;
     int server;
@@ -0,0 +1,50 @@
+#include "ShadowRegister.h"
+#include "task.h"
+
+ShadowRegister::ShadowRegister(std::shared_ptr<ModbusClient> client_, int server_address, int register_address) :
+        reg(std::move(client_), server_address, register_address, true) {
+}
+
+void ShadowRegister::write(uint16_t value) {
+    if (commanded && in_sync && value == shadow &&
+        xTaskGetTickCount() - last_write < pdMS_TO_TICKS(SHADOW_REFRESH_MS)) {
+        ++skipped;
+        return;
+    }
+    shadow = value;
+    commanded = true;
+    commit();
+}
+
+uint16_t ShadowRegister::read() const {
+    return shadow;
+}
+
+bool ShadowRegister::commit() {
+    in_sync = reg.write(shadow);
+    ++writes;
+    last_write = xTaskGetTickCount();
+    last_verify = last_write;
+    return in_sync;
+}
+
+bool ShadowRegister::sync() {
+    if (!commanded) return true;
+
+    TickType_t now = xTaskGetTickCount();
+    if (!in_sync || now - last_write >= pdMS_TO_TICKS(SHADOW_REFRESH_MS)) {
+        commit();
+        return true;
+    }
+    if (now - last_verify >= pdMS_TO_TICKS(SHADOW_VERIFY_MS)) {
+        last_verify = now;
+        uint16_t actual;
+        if (reg.read(&actual, 1) && actual != shadow) {
+            // device lost or overrode the command (power cycle, local override), put it back
+            ++divergences;
+            commit();
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,39 @@
+#ifndef SHADOWREGISTER_H
+#define SHADOWREGISTER_H
+
+#include <memory>
+#include "FreeRTOS.h"
+#include "ModbusRegister.h"
+
+// the commanded value is rewritten this often even if it hasn't changed
+#define SHADOW_REFRESH_MS (5 * 60 * 1000)
+// and read back this often to see that the device still has it
+#define SHADOW_VERIFY_MS (60 * 1000)
+
+// Holding register that remembers the last commanded value. Writes go on the bus only
+// when the value changes, the last write failed or the refresh interval has passed.
+class ShadowRegister {
+public:
+    ShadowRegister(std::shared_ptr<ModbusClient> client_, int server_address, int register_address);
+    void write(uint16_t value);
+    // commanded value
+    uint16_t read() const;
+    // refresh and read back when due, returns false if the device had a different value
+    bool sync();
+
+    uint32_t writes = 0;
+    uint32_t skipped = 0;
+    uint32_t divergences = 0;
+
+private:
+    bool commit();
+
+    ModbusRegister reg;
+    uint16_t shadow = 0;
+    bool commanded = false; // nothing to keep before the first write
+    bool in_sync = false;   // device is known to have the shadow value
+    TickType_t last_write = 0;
+    TickType_t last_verify = 0;
+};
+
+#endif //SHADOWREGISTER_H
@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+"""Decodes event log records of the controller.
+
+Input is either the serial output of the storage console command d (lines "EV <addr> <seq> <hex>")
+or, with --image, a raw dump of the whole eeprom. Event names come from src/EEPROM/EventLog.h.
+"""
+import argparse
+import os
+import re
+import struct
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+HEADER = os.path.join(HERE, "..", "..", "src", "EEPROM", "EventLog.h")
+
+PAGE_SIZE = 64
+SLOT_SIZE = 12
+LOG_ADDR = 0x1000
+LOG_SIZE = 0x1000
+EPOCH_RING_ADDR = 0x0300
+EPOCH_SLOT_SIZE = 8
+EPOCH_SLOTS = 16
+
+
+def load_codes(path):
+    codes = {}
+    with open(path) as f:
+        for line in f:
+            m = re.match(r"\s*(EV_\w+)\s*=\s*(\d+),\s*//\s*(.*)", line)
+            if m:
+                codes[int(m.group(2))] = (m.group(1), m.group(3).strip())
+    return codes
+
+
+def crc16(data, crc=0xFFFF):
+    for b in data:
+        x = ((crc >> 8) ^ b) & 0xFF
+        x ^= x >> 4
+        crc = ((crc << 8) ^ (x << 12) ^ (x << 5) ^ x) & 0xFFFF
+    return crc
+
+
+def epoch_seed(epoch):
+    return 0xFFFF if epoch == 0 else crc16(bytes([epoch & 0xFF, epoch >> 8]))
+
+
+def log_epoch(image):
+    """Log epoch from the newest valid slot of the epoch ring, 0 if there is none."""
+    newest = None
+    for i in range(EPOCH_SLOTS):
+        addr = EPOCH_RING_ADDR + i * EPOCH_SLOT_SIZE
+        slot = image[addr:addr + EPOCH_SLOT_SIZE]
+        if len(slot) < EPOCH_SLOT_SIZE or crc16(slot[:-2]) != (slot[-2] << 8 | slot[-1]):
+            continue
+        seq = slot[0] | slot[1] << 8
+        if newest is None or ((seq - newest[0]) & 0xFFFF) < 0x8000:
+            newest = (seq, slot[4] | slot[5] << 8)
+    return newest[1] if newest else 0
+
+
+def records_from_dump(lines):
+    for line in lines:
+        parts = line.split()
+        if len(parts) == 4 and parts[0] == "EV":
+            yield int(parts[1], 16), int(parts[2], 16), bytes.fromhex(parts[3])
+
+
+def records_from_image(image):
+    seed = epoch_seed(log_epoch(image))
+    per_page = PAGE_SIZE // SLOT_SIZE
+    slots = {}
+    for page in range(LOG_SIZE // PAGE_SIZE):
+        for i in range(per_page):
+            addr = LOG_ADDR + page * PAGE_SIZE + i * SLOT_SIZE
+            slot = image[addr:addr + SLOT_SIZE]
+            if len(slot) < SLOT_SIZE:
+                continue
+            if crc16(slot[:-2], seed) != (slot[-2] << 8 | slot[-1]):
+                continue
+            seq = slot[0] | slot[1] << 8
+            slots[page * per_page + i] = (addr, seq, slot[2:-2])
+    if not slots:
+        return []
+    # oldest first. Sequence numbers are 16 bit and wrap, so the newest record is found as the
+    # Journal does on the device: slot i holds seq(0) + i up to the newest one
+    slot_count = LOG_SIZE // PAGE_SIZE * per_page
+    if 0 in slots:
+        first_seq = slots[0][1]
+        head = 0
+        while head + 1 in slots and (slots[head + 1][1] - first_seq) & 0xFFFF == head + 1:
+            head += 1
+        newest = slots[head][1]
+    elif slot_count - 1 in slots:
+        # first slot of a new lap torn while writing, the newest record is the last slot
+        newest = slots[slot_count - 1][1]
+    else:
+        newest = max(seq for _, seq, _ in slots.values())
+    return sorted(slots.values(), key=lambda r: (r[1] - newest - 1) & 0xFFFF)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("input", nargs="?", help="dump file, stdin if omitted")
+    parser.add_argument("--image", action="store_true", help="input is a raw eeprom image")
+    parser.add_argument("--header", default=HEADER, help="path to EventLog.h")
+    args = parser.parse_args()
+
+    codes = load_codes(args.header)
+    if args.image:
+        with open(args.input, "rb") as f:
+            records = records_from_image(f.read())
+    else:
+        src = open(args.input) if args.input else sys.stdin
+        records = list(records_from_dump(src))
+
+    for addr, seq, payload in records:
+        code, zone, value, time = struct.unpack("<BBHI", payload[:8])
+        name, description = codes.get(code, ("EV_%u" % code, "unknown"))
+        print("0x%04X #%5u t=%10u z%-2u %-20s %5u  %s" % (addr, seq, time, zone, name, value, description))
+
+
+if __name__ == "__main__":
+    main()
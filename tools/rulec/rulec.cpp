@@ -0,0 +1,79 @@
+// Host side rule compiler. Compiles a rule file to the bytecode stored in EEPROM
+// and optionally measures how long one evaluation of the program takes.
+//
+// usage: rulec <rules.txt> [-b]
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "RuleCompiler.h"
+#include "RuleEngine.h"
+
+static bool read_file(const char *path, std::string &text) {
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f) return false;
+    char chunk[256];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        text.append(chunk, n);
+    }
+    if (f != stdin) fclose(f);
+    return true;
+}
+
+static void benchmark(const RuleEngine &engine) {
+    const int rounds = 1000000;
+    // a mid range sample so that comparisons go both ways
+    int32_t inputs[CH_COUNT] = {8000, 215, 650, 0, 7000, 20000};
+    RuleTimers timers{};
+    RuleActions actions;
+    int32_t sink = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        inputs[CH_CO2] = 6000 + (i & 0x3FFF);
+        engine.evaluate(inputs, timers, i, actions);
+        sink += actions.fan + actions.block_dose;
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    printf("benchmark: %d rules, %zu bytes, %.1f ns per evaluation (%d)\n",
+           engine.rule_count(), engine.size(), static_cast<double>(ns) / rounds, sink & 1);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <rules.txt|-> [-b]\n", argv[0]);
+        return 2;
+    }
+    std::string text;
+    if (!read_file(argv[1], text)) {
+        fprintf(stderr, "cannot read %s\n", argv[1]);
+        return 1;
+    }
+
+    uint8_t program[RULE_PROGRAM_MAX];
+    RuleCompiler compiler;
+    size_t len = compiler.compile(text.c_str(), program, sizeof(program));
+    if (len == 0) {
+        fprintf(stderr, "line %d: %s\n", compiler.error_line(), compiler.error());
+        return 1;
+    }
+
+    RuleEngine engine;
+    if (!engine.load(program, len)) {
+        fprintf(stderr, "compiled program failed verification\n");
+        return 1;
+    }
+
+    printf("%d rules, %zu bytes:\n", engine.rule_count(), len);
+    for (size_t i = 0; i < len; i++) {
+        printf("%02X%s", program[i], (i % 16 == 15 || i == len - 1) ? "\n" : " ");
+    }
+
+    if (argc > 2 && strcmp(argv[2], "-b") == 0) {
+        benchmark(engine);
+    }
+    return 0;
+}
@@ -0,0 +1,191 @@
+// Host benchmark of the multi-zone control cycle. Each zone's GMP252, HMP60 and Produal are
+// simulated on a 9600 bps RTU bus. The zone state, the poll budget arithmetic (ZoneSchedule.h)
+// and the control pass of a zone (ZoneControl.cpp) are the ones Control uses.
+// For 1 to 16 zones it reports:
+// - the simulated bus time and cycle time
+// - how many zones are polled per cycle and the worst staleness
+// - the CPU time of the control pass over the zone state array
+// The table is printed twice: once with devices answering in normal time, once with devices
+// that answer at the modbus timeout, where the bus budget limits the zones polled per cycle.
+//
+// usage: zonebench [cycles] [rules.txt]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include "Rules/RuleCompiler.h"
+#include "Rules/RuleEngine.h"
+#include "Task_Control/ZoneSchedule.h"
+#include "Task_Control/ZoneControl.h"
+
+#define BAUD_RATE 9600
+// start, 8 data and 2 stop bits
+#define BITS_PER_CHAR 11
+#define CHAR_US (BITS_PER_CHAR * 1000000 / BAUD_RATE)
+
+// rules used when no rule file is given, close to what a greenhouse would run
+static const char *bench_rules =
+    "when rh > 85 for 120 then fan 40\n"
+    "when temp > 28 then fan 60\n"
+    "when temp < 10 then nodose\n"
+    "when fan > 0 then nodose\n"
+    "when co2 > 1800 and not (rh < 40) then fan 80\n";
+
+// limits Control starts with
+#define MAX_CO2 2000
+#define MAX_FAN_SPEED 100
+// the firmware ticks at 1 kHz, the bench counts its time in ms
+#define CYCLE_MS 20000
+
+// time a device takes to answer, the second table uses the 500 ms modbus timeout
+static uint32_t device_floor_us = 0;
+static volatile int32_t sink;
+
+// one modbus transaction: request and response frames, the 3.5 character gap after each and
+// the time the device takes to answer
+static uint32_t transaction_us(int request, int response, uint32_t device_us) {
+    return (request + response + 7) * CHAR_US + (device_us > device_floor_us ? device_us : device_floor_us);
+}
+
+// bus time of one zone poll. The fan register is only written when the speed changes
+static uint32_t poll_us(std::mt19937 &rng, bool fan_write) {
+    std::uniform_int_distribution<uint32_t> jitter(0, 10000);
+    uint32_t us = transaction_us(8, 7, 15000 + jitter(rng));      // GMP252 co2, 1 register
+    us += transaction_us(8, 9, 25000 + jitter(rng));               // HMP60 RH and T, 2 registers
+    us += transaction_us(8, 7, 5000 + jitter(rng));                // Produal pulse read back
+    if (fan_write) us += transaction_us(8, 8, 5000 + jitter(rng)); // Produal speed write
+    return us;
+}
+
+struct Result {
+    double bus_ms;
+    double polled;
+    unsigned max_stale;
+    double cpu_ns;
+};
+
+static Result run(unsigned zone_count, int cycles, const RuleEngine &rules) {
+    static ZoneState zones[MAX_ZONES];
+    static RuleTimers timers[MAX_ZONES];
+    std::mt19937 rng(zone_count);
+    std::uniform_int_distribution<int> co2_walk(-150, 150);
+
+    for (unsigned z = 0; z < zone_count; z++) {
+        zones[z] = ZoneState{};
+        zones[z].co2_val = 700;
+        zones[z].co2_set = 700;
+        zones[z].temperature = 215;
+        zones[z].humidity = 650;
+        timers[z] = RuleTimers{};
+    }
+
+    uint32_t zone_poll = ZONE_POLL_ESTIMATE_US;
+    unsigned next_zone = 0;
+    uint64_t bus_total = 0;
+    uint64_t polled_total = 0;
+    unsigned max_stale = 0;
+    int64_t cpu_total_ns = 0;
+
+    for (int cycle = 0; cycle < cycles; cycle++) {
+        unsigned count = zones_per_cycle(zone_poll, zone_count);
+        uint32_t bus = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < count; i++) {
+            ZoneState &state = zones[(next_zone + i) % zone_count];
+            // simulated readings
+            int co2 = state.co2_val + co2_walk(rng);
+            state.co2_val = co2 < 300 ? 300 : co2 > 2500 ? 2500 : co2;
+            state.humidity = 600 + rng() % 300;
+            state.temperature = static_cast<int16_t>(rng() % 400) - 50;
+            state.stale_cycles = 0;
+
+            // the control pass Control::control_zone runs for a polled zone, the fan register
+            // is only written when the speed changes
+            uint32_t now = static_cast<uint32_t>(cycle) * CYCLE_MS;
+            int32_t inputs[CH_COUNT];
+            zone_rule_inputs(state, MAX_CO2, inputs);
+            RuleActions actions;
+            rules.evaluate(inputs, timers[(next_zone + i) % zone_count], now, actions);
+            uint16_t speed = zone_fan_speed(state, state.fan_speed, MAX_CO2, MAX_FAN_SPEED, actions.fan);
+            bool fan_write = speed != state.fan_speed;
+            state.fan_speed = speed;
+            // Control::dose_co2 opens the valve and starts the lockout
+            if (zone_wants_dose(state, actions.block_dose, now, VALVE_LOCKOUT_MS)) {
+                state.valve_open = true;
+                state.last_valve_time = now;
+                sink = sink + 1;
+            }
+
+            bus += poll_us(rng, fan_write);
+        }
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        cpu_total_ns += ns;
+
+        for (unsigned i = count; i < zone_count; i++) {
+            ZoneState &skipped = zones[(next_zone + i) % zone_count];
+            if (skipped.stale_cycles < UINT8_MAX) skipped.stale_cycles++;
+            if (skipped.stale_cycles > max_stale) max_stale = skipped.stale_cycles;
+        }
+        next_zone = (next_zone + count) % zone_count;
+        zone_poll = zone_poll_average(zone_poll, bus + static_cast<uint32_t>(ns / 1000), count);
+        bus_total += bus;
+        polled_total += count;
+    }
+
+    Result result{};
+    result.bus_ms = bus_total / 1000.0 / cycles;
+    result.polled = static_cast<double>(polled_total) / cycles;
+    result.max_stale = max_stale;
+    result.cpu_ns = static_cast<double>(cpu_total_ns) / cycles;
+    return result;
+}
+
+static bool read_file(const char *path, std::string &text) {
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+    char chunk[256];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        text.append(chunk, n);
+    }
+    fclose(f);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int cycles = argc > 1 ? atoi(argv[1]) : 1000;
+    if (cycles < 1) {
+        fprintf(stderr, "usage: %s [cycles] [rules.txt]\n", argv[0]);
+        return 2;
+    }
+    std::string text = bench_rules;
+    if (argc > 2 && !read_file(argv[2], text = "")) {
+        fprintf(stderr, "cannot read %s\n", argv[2]);
+        return 1;
+    }
+
+    uint8_t program[RULE_PROGRAM_MAX];
+    RuleCompiler compiler;
+    size_t len = compiler.compile(text.c_str(), program, sizeof(program));
+    RuleEngine rules;
+    if (len == 0 || !rules.load(program, len)) {
+        fprintf(stderr, "line %d: %s\n", compiler.error_line(), compiler.error());
+        return 1;
+    }
+
+    printf("%d cycles, %d rules, bus budget %d ms of the 20 s period\n",
+           cycles, rules.rule_count(), ZONE_BUS_BUDGET_US / 1000);
+    for (uint32_t floor_us: {0u, 500000u}) {
+        device_floor_us = floor_us;
+        printf("\n%s\n", floor_us ? "devices answering at the timeout:" : "devices answering normally:");
+        printf("zones  polled/cycle  bus ms/cycle  max stale  control us/cycle\n");
+        for (unsigned zones = 1; zones <= MAX_ZONES; zones++) {
+            Result r = run(zones, cycles, rules);
+            printf("%5u  %12.1f  %12.1f  %9u  %16.2f\n", zones, r.polled, r.bus_ms, r.max_stale, r.cpu_ns / 1000.0);
+        }
+    }
+    return 0;
+}